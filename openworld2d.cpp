@@ -1,8 +1,43 @@
+#ifndef OW2D_NO_CONSOLE
 #include "advancedConsole.h"
 #include "colorMappingFast.h"
+#else
+//headless, server and export builds, nothing of the console is linked or constructed
+#include <chrono>
+#include <thread>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+typedef unsigned char color_t;
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <new>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 struct tile;
 struct tileState;
@@ -22,9 +57,12 @@ int tileMapWidth = 128;
 const int chunkSize = 16;
 int chunkCountX = 8;
 int chunkCountY = 8;
+int chunkCountPrev;
 
 int textureSize = 8;
 double scale = 4.0f;
+double lodScale = 1.0f;
+double minScale = 0.0625f;
 int selectorTileId = 0;
 double viewX;
 double viewY;
@@ -52,6 +90,12 @@ double playerYacceleration;
 bool grounded;
 double gravity = -9.8f;
 
+unsigned int worldSeed;
+
+float frameReserve = 2.0f;
+//how far from the player tiles can be placed and broken
+float reach = 8.0f;
+
 unsigned char *texture;
 int textureHeight;
 int textureWidth;
@@ -101,6 +145,123 @@ ch_co_t sampleImageCHCO(float x, float y) {
 	return chco;
 }
 
+//Frame buffer
+
+std::vector<ch_co_t> frameCells;
+int frameWidth;
+int frameHeight;
+
+//a band of rows of the frame, only ever drawn into by one thread
+struct canvas {
+	int y0, y1;
+	int drawCalls;
+	int pixelsDrawn;
+	
+	bool bound(int x, int y) {
+		return x >= 0 && x < frameWidth && y >= y0 && y < y1;
+	}
+	
+	void write(int x, int y, wchar_t ch, color_t co) {
+		ch_co_t &cell = frameCells[y * frameWidth + x];
+		cell.ch = ch;
+		cell.co = co;
+	}
+};
+
+//Color lookup table
+
+#define LUT_BITS 6
+const int lutSize = 1 << LUT_BITS;
+const int lutShift = 8 - LUT_BITS;
+wchar_t *lutCh;
+color_t *lutCo;
+pixel textureTint(255, 255, 255);
+pixel textureTintTarget(255, 255, 255);
+
+#ifndef OW2D_NO_CONSOLE
+void buildColorLut() {
+	int entries = lutSize * lutSize * lutSize;
+	lutCh = new wchar_t[entries];
+	//padded so a 32 bit gather at the last entry stays in bounds
+	lutCo = new color_t[entries + 3]();
+	
+	for (int r = 0; r < lutSize; r++) {
+		for (int g = 0; g < lutSize; g++) {
+			for (int b = 0; b < lutSize; b++) {
+				int half = (1 << lutShift) >> 1;
+				int i = (r << (LUT_BITS * 2)) | (g << LUT_BITS) | b;
+				getDitherColored((r << lutShift) + half, (g << lutShift) + half, (b << lutShift) + half, &lutCh[i], &lutCo[i]);
+			}
+		}
+	}
+}
+#endif
+
+//tint channels are 0-255, 255 leaves the color unchanged
+ch_co_t lutLookup(int r, int g, int b, int a, pixel tint) {
+	r = (r * (tint.r + 1)) >> 8;
+	g = (g * (tint.g + 1)) >> 8;
+	b = (b * (tint.b + 1)) >> 8;
+	int i = ((r >> lutShift) << (LUT_BITS * 2)) | ((g >> lutShift) << LUT_BITS) | (b >> lutShift);
+	ch_co_t chco;
+	chco.ch = lutCh[i];
+	chco.co = lutCo[i];
+	chco.a = a;
+	return chco;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//rgba pixels eight at a time, built for avx2 whatever the target flags and only called when the cpu has it
+//returns how many pixels were converted, the rest is left to the scalar loop
+__attribute__((target("avx2")))
+int convertRowAvx2(const unsigned char *src, int count, pixel tint, ch_co_t *dst) {
+	int i = 0;
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	const __m256i tr = _mm256_set1_epi32(tint.r + 1);
+	const __m256i tg = _mm256_set1_epi32(tint.g + 1);
+	const __m256i tb = _mm256_set1_epi32(tint.b + 1);
+	alignas(32) int ch[8], co[8], al[8];
+	for (; i + 8 <= count; i += 8) {
+		__m256i px = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+		__m256i r = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(px, mask), tr), 8);
+		__m256i g = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(px, 8), mask), tg), 8);
+		__m256i b = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(px, 16), mask), tb), 8);
+		__m256i idx = _mm256_or_si256(_mm256_or_si256(
+			_mm256_slli_epi32(_mm256_srli_epi32(r, lutShift), LUT_BITS * 2),
+			_mm256_slli_epi32(_mm256_srli_epi32(g, lutShift), LUT_BITS)),
+			_mm256_srli_epi32(b, lutShift));
+		_mm256_store_si256((__m256i*)ch, _mm256_i32gather_epi32((const int*)lutCh, idx, sizeof(wchar_t)));
+		_mm256_store_si256((__m256i*)co, _mm256_and_si256(_mm256_i32gather_epi32((const int*)lutCo, idx, 1), mask));
+		_mm256_store_si256((__m256i*)al, _mm256_srli_epi32(px, 24));
+		for (int j = 0; j < 8; j++) {
+			dst[i + j].ch = ch[j];
+			dst[i + j].co = co[j];
+			dst[i + j].a = al[j];
+		}
+	}
+	return i;
+}
+#endif
+
+//converts count pixels of an 8 bit rgb(a) row into console cells
+void convertRow(const unsigned char *src, int bpp, int count, pixel tint, ch_co_t *dst) {
+	int i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	if (bpp == 4 && avx2)
+		i = convertRowAvx2(src, count, tint, dst);
+#endif
+	for (; i < count; i++) {
+		const unsigned char *p = src + i * bpp;
+		dst[i] = lutLookup(p[0], p[1], p[2], bpp == 4 ? p[3] : 255, tint);
+	}
+}
+
+void convertTexture() {
+	for (int y = 0; y < textureHeight; y++)
+		convertRow(texture + y * textureWidth * bpp, bpp, textureWidth, textureTint, texturechco + y * textureWidth);
+}
+
 struct tiles {
 	static tile *tileRegistry[TILE_COUNT];
 	static int id;
@@ -121,7 +282,9 @@ world_t *world;
 struct chunk_t;
 
 struct world_t {	
-	chunk_t *chunks;
+	chunk_t **chunks;
+	//chunk coordinates of chunks[0], only moved by map export
+	int originX = 0, originY = 0;
 
 	tileState *getState(int x, int y);
 	
@@ -129,6 +292,10 @@ struct world_t {
 	
 	tile *getTile(tileState *state);
 	
+	chunk_t *getChunk(int cx, int cy);
+	
+	void set(int x, int y, tileState state);
+	
 	tileComplete place(int x, int y, tileState tile);
 };
 
@@ -155,16 +322,84 @@ struct tileState {
 	}
 };
 
+enum genStage {
+	GEN_NONE,
+	GEN_TERRAIN,
+	GEN_CARVED,
+	GEN_DECORATED,	//trees and structures, may write into neighbors
+	GEN_FINALIZED,	//connections and summaries
+};
+
 struct chunk_t {
 	tileState tileMap[chunkSize][chunkSize];
 	
-	void generate();
+	//level of detail, dominant tile per 2x2, 4x4 and 16x16 block
+	tile_id lod2[chunkSize / 2][chunkSize / 2];
+	tile_id lod4[chunkSize / 4][chunkSize / 4];
+	tile_id lod16;
+	unsigned short tileCount[TILE_COUNT];
+	
+	//bit x of solid[y] for every non air tile, bit y of solidRows for every row with any
+	unsigned short solid[chunkSize];
+	unsigned short solidRows;
+	
+	//hash of the structure that placed each tile while decorating, noDecoration for terrain
+	unsigned int decoration[chunkSize][chunkSize];
+	static const unsigned int noDecoration = ~0u;
+	
+	void generateTerrain();
+	void carve();
+	void decorate();
+	void finalize();
+	bool canAdvance();
+	void advance();
+	
+	tile_id dominant(int x, int y, int size);
+	void buildSummary();
+	void updateSummary(int x, int y, tile_id old);
+	tile_id getSummary(int level, int x, int y);
 	
 	int originX, originY;
 	
-	bool generated;
+	int stage;
+	unsigned int poolIndex;
+	
+	void clear();
+};
+
+//fixed size slabs of chunks handed out through a lock free free list
+struct chunkPool {
+	static const int slabBytes = 2 << 20;
+	static const int slabChunks = slabBytes / (sizeof(chunk_t) + sizeof(unsigned int));
+	//slabs are found through blocks of slab pointers that never move once published
+	static const int slabsPerBlock = 1024;
+	static const int maxBlocks = (1ull << 32) / slabChunks / slabsPerBlock;
+	
+	struct slab {
+		chunk_t chunks[slabChunks];
+		std::atomic<unsigned int> next[slabChunks];
+	};
+	
+	std::atomic<slab**> blocks[maxBlocks];
+	std::atomic<int> slabCount;
+	//tag in the high half against ABA, slot index + 1 in the low half, 0 when empty
+	std::atomic<unsigned long long> head;
+	std::mutex growLock;
+	std::atomic<int> live, peak;
+	bool hugePages;
+	
+	chunk_t *alloc();
+	void free(chunk_t *chunk);
+	bool grow();
+	long long capacity() { return (long long)slabCount * slabChunks; }
+	
+	slab *slabAt(unsigned int n) { return blocks[n / slabsPerBlock].load(std::memory_order_acquire)[n % slabsPerBlock]; }
+	chunk_t *at(unsigned int index) { return &slabAt(index / slabChunks)->chunks[index % slabChunks]; }
+	std::atomic<unsigned int> &nextOf(unsigned int index) { return slabAt(index / slabChunks)->next[index % slabChunks]; }
 };
 
+chunkPool chunkpool;
+
 struct tile {
 	tile_id id;
 	tileState defaultState;
@@ -203,21 +438,22 @@ struct tile {
 		return state;
 	}
 	
-	virtual void draw(tileComplete *tc, float offsetx, float offsety, float sizex, float sizey) {
-		d_drawCallCount++;
-		if (offsetx >= adv::width || offsety >= adv::height || offsetx + sizex < 0 || offsety + sizey < 0)
+	virtual void draw(tileComplete *tc, canvas *cv, float offsetx, float offsety, float sizex, float sizey) {
+		cv->drawCalls++;
+		if (offsetx >= frameWidth || offsety >= cv->y1 || offsetx + sizex < 0 || offsety + sizey < cv->y0)
 			return;
+		int ystart = std::max(0, int(cv->y0 - offsety));
 		for (int x = 0; x < sizex; x++) {
-			for (int y = 0; y < sizey; y++) {
-				if (offsetx + x >= adv::width || offsety + y >= adv::height || offsetx + x < 0 || offsety + y < 0)
+			for (int y = ystart; y < sizey && offsety + y < cv->y1; y++) {
+				if (offsetx + x >= frameWidth || offsetx + x < 0 || offsety + y < cv->y0)
 					continue;
 				float xf = ((textureAtlas[0] * textureSize) + ((float(x) / sizex) * textureSize)) / textureWidth;
 				float yf = ((textureAtlas[1] * textureSize) + ((float(y) / sizey) * textureSize)) / textureHeight;
 				ch_co_t chco = sampleImageCHCO(xf, yf);
 				if (chco.a < 255)
 					continue;
-				d_pixelDrawn++;
-				adv::write(offsetx + x, offsety + y, chco.ch, chco.co);
+				cv->pixelsDrawn++;
+				cv->write(offsetx + x, offsety + y, chco.ch, chco.co);
 			}
 		}
 	}
@@ -230,10 +466,32 @@ struct tile {
 };
 
 
+struct chunkConsumer;
+
 struct chunkServer {
+	int fd = -1;
+	std::vector<chunkConsumer*> consumers;
+	std::vector<long long> edits;
+	int maxChunksPerTick = 64;
+	//no new chunks for a consumer until it has read its backlog down to this
+	int maxBufferedBytes = 256 << 10;
+	long long bytesSent = 0;
+	int chunksSent = 0;
 	
+	bool listen(const char *address);
+	void onPlace(int x, int y);
+	void tick();
+	void accept();
+	bool receive(chunkConsumer *consumer);
+	void handle(chunkConsumer *consumer, unsigned char type, const char *p, int len);
+	void subscribe(chunkConsumer *consumer);
+	void sendDeltas();
+	void sendChunks(chunkConsumer *consumer);
+	bool flush(chunkConsumer *consumer);
 };
 
+chunkServer *server;
+
 /*
 
 chunking thoughts
@@ -255,8 +513,16 @@ no this will not work
 */
 
 struct chunkConsumer {
-	int x, int y;
+	int x, y;
 	int chunks;
+	int fd;
+	std::string in, out;
+	std::vector<bool> subscribed;
+	std::vector<int> pending;
+	
+	bool inView(int cx, int cy) {
+		return abs(cx - x) <= chunks && abs(cy - y) <= chunks;
+	}
 	
 	void setPosition(int x, int y) {
 		this->x = x;
@@ -270,6 +536,138 @@ struct chunkConsumer {
 
 
 
+struct chunkClient {
+	int fd = -1;
+	std::string in, out;
+	int viewX = -1, viewY = -1;
+	int distance = 4;
+	
+	bool connect(const char *address);
+	void setView(int cx, int cy);
+	void place(int x, int y, tileState state);
+	void resync();
+	void poll();
+	void handle(unsigned char type, const char *p, int len);
+};
+
+chunkClient *client;
+
+struct workerPool {
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake, done;
+	std::function<void(int)> job;
+	std::atomic<int> next;
+	int count;
+	int busy;
+	unsigned int generation;
+	bool running;
+	
+	void start(int count);
+	void run();
+	void work();
+	void parallelFor(int count, const std::function<void(int)> &job);
+};
+
+workerPool *workers;
+
+//a step does a small slice of work and returns false once the task is done
+struct task {
+	const char *name;
+	int priority;
+	std::function<bool()> step;
+	float cost;
+	unsigned long long lastRun;
+};
+
+struct taskScheduler {
+	std::vector<task> tasks;
+	unsigned long long stepCount = 0;
+	
+	void submit(const char *name, int priority, std::function<bool()> step);
+	void cancel(const char *name);
+	int pick();
+	void runStep(int i);
+	int run(std::chrono::steady_clock::time_point deadline);
+	int runSteps(int count);
+};
+
+taskScheduler scheduler;
+
+struct pathRequest {
+	int sx, sy, gx, gy;
+	std::atomic<int> state{IDLE};
+	std::vector<std::pair<int,int>> path;
+	
+	enum { IDLE, PENDING, FOUND, UNREACHABLE };
+};
+
+struct navPortal {
+	unsigned char x, y, dir;
+};
+
+struct navChunk {
+	unsigned short solid[chunkSize];
+	std::vector<navPortal> portals;
+	std::vector<int> cost;
+	bool dirty;
+	
+	bool blocked(int x, int y) {
+		return solid[y] >> x & 1;
+	}
+};
+
+struct navEdit {
+	int chunk, row;
+	unsigned short mask;
+};
+
+//hierarchical search over portals on chunk borders, refined tile by tile inside each chunk
+struct pathfinder {
+	static const int maxPortals = chunkSize * 2;
+	
+	struct goalField {
+		unsigned int version;
+		std::vector<int> dist, next;
+	};
+	
+	std::vector<navChunk> chunks;
+	int countX, countY;
+	unsigned int version;
+	std::map<long long, goalField> fields;
+	
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::vector<pathRequest*> queue;
+	//latest solid rows from the main thread and which rows of each chunk changed since the worker last looked
+	//sized by the world, so any number of edits between requests takes no more room
+	std::vector<unsigned short> incoming;
+	std::vector<unsigned short> incomingRows;
+	std::vector<int> incomingChunks;
+	int resetX = -1, resetY = -1;
+	bool running;
+	std::atomic<int> solved;
+	
+	void start();
+	void stop();
+	void reset();
+	void onPlace(int x, int y);
+	void onChunk(chunk_t *chunk);
+	void markRow(int c, int y, unsigned short mask);
+	void submit(pathRequest *request);
+	
+	void run();
+	void rebuild(int c);
+	int neighbor(int c, int dir);
+	int localSearch(int c, int from, int to, std::vector<int> *dist, std::vector<std::pair<int,int>> *path);
+	goalField *field(int gx, int gy);
+	bool solve(pathRequest *request);
+};
+
+pathfinder *paths;
+pathRequest debugPath;
+
 struct tileable : public tile {
 	tileable() {}
 	tileable(int t0, int t1, int t2, int t3, bool skip = false) 
@@ -312,8 +710,10 @@ struct tileable : public tile {
 		}
 	}
 	
-	void draw(tileComplete *tc, float offsetx, float offsety, float sizex, float sizey) override {
-		d_drawCallCount++;
+	void draw(tileComplete *tc, canvas *cv, float offsetx, float offsety, float sizex, float sizey) override {
+		cv->drawCalls++;
+		if (offsety >= cv->y1 || offsety + sizey < cv->y0)
+			return;
 		//NORTH
 		float svars[][4] = {
 			{0, sizex, 0, (sizey*svarSize)},
@@ -322,9 +722,10 @@ struct tileable : public tile {
 			{0, sizex * svarSize, 0, sizey}
 		};
 				
+		int ystart = std::max(0, int(cv->y0 - offsety));
 		for (int x = 0; x < sizex; x++) {
-			for (int y = 0; y < sizey; y++) {		
-				if (!adv::bound(offsetx + x, offsety + y))
+			for (int y = ystart; y < sizey && offsety + y < cv->y1; y++) {		
+				if (!cv->bound(offsetx + x, offsety + y))
 					continue;
 				float xf = ((textureAtlas[0] * textureSize) + ((float(x) / sizex) * textureSize)) / textureWidth;
 				float yf = ((textureAtlas[1] * textureSize) + ((float(y) / sizey) * textureSize)) / textureHeight;
@@ -346,8 +747,8 @@ struct tileable : public tile {
 				}
 				if (chco.a  < 255)
 					continue;
-				d_pixelDrawn++;
-				adv::write(offsetx + x, offsety + y, chco.ch, chco.co);
+				cv->pixelsDrawn++;
+				cv->write(offsetx + x, offsety + y, chco.ch, chco.co);
 			}
 		}		
 	}
@@ -379,12 +780,14 @@ tile *tiles::get(tile_id id) {
 }
 
 tileState *world_t::getState(int x, int y) {
-		if (x >= tileMapWidth || x < 0 || y >= tileMapWidth || y < 0)
+		x -= originX * chunkSize;
+		y -= originY * chunkSize;
+		if (x >= tileMapWidth || x < 0 || y >= tileMapHeight || y < 0)
 			return &tiles::AIR->defaultState;
 		//return &tileMap[y * tileMapWidth + x];
 		int coriginx = x / chunkSize;
 		int coriginy = y / chunkSize;
-		return &chunks[coriginy * chunkCountX + coriginx].tileMap[x - (coriginx * chunkSize)][y - (coriginy * chunkSize)];
+		return &chunks[coriginy * chunkCountX + coriginx]->tileMap[x - (coriginx * chunkSize)][y - (coriginy * chunkSize)];
 }
 
 tileComplete world_t::getComplete(int x, int y) {
@@ -400,10 +803,32 @@ tile *world_t::getTile(tileState *state) {
 	return tiles::get(state->id);
 }
 
+chunk_t *world_t::getChunk(int cx, int cy) {
+	cx -= originX;
+	cy -= originY;
+	if (cx >= chunkCountX || cx < 0 || cy >= chunkCountY || cy < 0)
+		return nullptr;
+	return chunks[cy * chunkCountX + cx];
+}
+
+//raw write without tile callbacks, keeps chunk summaries current
+void world_t::set(int x, int y, tileState state) {
+	tileState *tp = getState(x,y);
+	tile_id old = tp->id;
+	*tp = state;
+	
+	chunk_t *chunk = (x >= 0 && y >= 0) ? getChunk(x / chunkSize, y / chunkSize) : nullptr;
+	if (chunk)
+		chunk->updateSummary(x - (chunk->originX * chunkSize), y - (chunk->originY * chunkSize), old);
+	if (chunk && paths)
+		paths->onPlace(x, y);
+}
+
 tileComplete world_t::place(int x, int y, tileState tile) {
 	tileComplete stale = getComplete(x,y);
 	stale.parent->onDestroy(&stale, x, y);
-	*getState(x,y) = tile;
+	set(x, y, tile);
+	
 	tileComplete newtile = getComplete(x,y);
 	newtile.parent->onCreate(&newtile, x, y);
 	
@@ -417,6 +842,9 @@ tileComplete world_t::place(int x, int y, tileState tile) {
 	neighbor = getComplete(WEST_F);
 	neighbor.parent->onUpdate(&neighbor, WEST_F);		
 	
+	if (server)
+		server->onPlace(x, y);
+	
 	return newtile;
 }
 
@@ -532,25 +960,111 @@ float perlin::getNormalNoise(float x, float z) {
 }
 #endif
 
-void chunk_t::generate() {
+//Generation
+
+//per tile randomness that does not depend on generation order
+unsigned int tileHash(int x, int y, unsigned int salt) {
+	unsigned int h = worldSeed ^ salt;
+	h ^= x * 0x27d4eb2d;
+	h = (h ^ (h >> 15)) * 0x85ebca6b;
+	h ^= y * 0x165667b1;
+	h = (h ^ (h >> 13)) * 0xc2b2ae35;
+	return h ^ (h >> 16);
+}
+
+void chunk_t::generateTerrain() {
 	int ofx = 128 - (originX * chunkSize);
 	int ofy = 128 - (originY * chunkSize);
 	
 	for (int x = 0; x < chunkSize; x++) {
 		for (int y = 0; y < chunkSize; y++) {
 			tileMap[x][y] = air->getDefaultState();
+			decoration[x][y] = noDecoration;
 			
 			//perlin::octaves = 2.0f;
 			if (perlin::getPerlin((ofx + x) * 0.1f + 1000.0f, ((ofy + y) / 2.0f) * 0.1f + 1000.0f) < 0.15f)
 			if (ofy + y < 112)
-				if (float(rand() % 120) / 120.0f < 0.8f * (float(ofy + y) / 120.0f))
+				if (float(tileHash(originX * chunkSize + x, originY * chunkSize + y, 1) % 120) / 120.0f < 0.8f * (float(ofy + y) / 120.0f))
 					tileMap[x][y] = dirt->getDefaultState();
 				else
 					tileMap[x][y] = stone->getDefaultState();
 		}
 	}
-	
-	//Creation update, not good enough to do texture connections
+}
+
+void chunk_t::carve() {
+	for (int x = 0; x < chunkSize; x++) {
+		for (int y = 0; y < chunkSize; y++) {
+			int wx = originX * chunkSize + x, wy = originY * chunkSize + y;
+			if (tileMap[x][y].id == air->id)
+				continue;
+			if (perlin::getPerlin(wx * 0.12f + 5000.0f, wy * 0.2f + 5000.0f) > 0.45f)
+				tileMap[x][y] = air->getDefaultState();
+		}
+	}
+}
+
+//air after carving, whatever decoration has put there since
+bool carvedAir(int x, int y) {
+	chunk_t *chunk = (x >= 0 && y >= 0) ? world->getChunk(x / chunkSize, y / chunkSize) : nullptr;
+	if (!chunk)
+		return false;
+	int lx = x - chunk->originX * chunkSize, ly = y - chunk->originY * chunkSize;
+	return chunk->tileMap[lx][ly].id == air->id || chunk->decoration[lx][ly] != chunk_t::noDecoration;
+}
+
+//only fills carved air inside the world, neighbors are at least carved
+//overlaps go to the lowest structure hash so the result does not depend on chunk order
+void decorateSet(int x, int y, tile *t, unsigned int h) {
+	if (!carvedAir(x, y))
+		return;
+	chunk_t *chunk = world->getChunk(x / chunkSize, y / chunkSize);
+	int lx = x - chunk->originX * chunkSize, ly = y - chunk->originY * chunkSize;
+	unsigned int &owner = chunk->decoration[lx][ly];
+	tileState &state = chunk->tileMap[lx][ly];
+	if (h < owner || (h == owner && t->id > state.id)) {
+		owner = h;
+		state = t->getDefaultState();
+	}
+}
+
+void chunk_t::decorate() {
+	for (int x = 0; x < chunkSize; x++) {
+		for (int y = 0; y < chunkSize; y++) {
+			int wx = originX * chunkSize + x, wy = originY * chunkSize + y;
+			if (tileMap[x][y].id != dirt->id || !carvedAir(wx, wy - 1))
+				continue;
+			
+			unsigned int h = tileHash(wx, wy, 2);
+			if (h % 9 == 0) {
+				//tree, leaves stop at the top of the trunk
+				int height = 3 + (h >> 8) % 3;
+				for (int i = 1; i <= height; i++)
+					decorateSet(wx, wy - i, wood_vertical, h);
+				for (int dx = -2; dx <= 2; dx++)
+					for (int dy = -2; dy <= 1; dy++)
+						if (dx * dx + dy * dy <= 5 && !(dx == 0 && dy > 0))
+							decorateSet(wx + dx, wy - height + dy, leaves, h);
+			} else
+			if (h % 97 == 1) {
+				//hut
+				for (int i = 0; i <= 4; i++) {
+					decorateSet(wx + i, wy - 4, stonebricks, h);
+					decorateSet(wx + i, wy, stonebricks, h);
+				}
+				for (int i = 1; i <= 3; i++) {
+					decorateSet(wx, wy - i, stonebricks, h);
+					decorateSet(wx + 4, wy - i, i == 2 ? glass : stonebricks, h);
+				}
+				decorateSet(wx + 1, wy - 3, wood_horizontal, h);
+				decorateSet(wx + 2, wy - 3, wood_horizontal, h);
+				decorateSet(wx + 3, wy - 3, wood_horizontal, h);
+			}
+		}
+	}
+}
+
+void chunk_t::finalize() {
 	for (int x = 0; x < chunkSize; x++) {
 		for (int y = 0; y < chunkSize; y++) {
 			int ofx = originX * chunkSize, ofy = originY * chunkSize;
@@ -558,10 +1072,473 @@ void chunk_t::generate() {
 			cmp.parent->onCreate(&cmp, ofx + x, ofy + y);
 		}
 	}
+	
+	buildSummary();
+	
+	if (paths)
+		paths->onChunk(this);
+}
+
+//decoration reaches one chunk out, so finalizing waits for everything two chunks out
+const int stageRadius[] = { 0, 0, 0, 1, 2 };
+
+bool chunk_t::canAdvance() {
+	int next = stage + 1;
+	if (next > GEN_FINALIZED)
+		return false;
+	int r = stageRadius[next];
+	for (int cx = originX - r; cx <= originX + r; cx++) {
+		for (int cy = originY - r; cy <= originY + r; cy++) {
+			chunk_t *chunk = world->getChunk(cx, cy);
+			if (chunk && chunk != this && chunk->stage < next - 1)
+				return false;
+		}
+	}
+	return true;
+}
+
+void chunk_t::advance() {
+	switch (stage + 1) {
+		case GEN_TERRAIN: generateTerrain(); break;
+		case GEN_CARVED: carve(); break;
+		case GEN_DECORATED: decorate(); break;
+		case GEN_FINALIZED: finalize(); break;
+	}
+	stage++;
+}
+
+//the chunk that has to advance next on the way to finalizing target
+chunk_t *nextAdvance(chunk_t *target) {
+	if (target->stage >= GEN_FINALIZED)
+		return nullptr;
+	if (target->canAdvance())
+		return target;
+	int r = stageRadius[target->stage + 1];
+	for (int cx = target->originX - r; cx <= target->originX + r; cx++) {
+		for (int cy = target->originY - r; cy <= target->originY + r; cy++) {
+			chunk_t *chunk = world->getChunk(cx, cy);
+			if (chunk && chunk->stage < target->stage)
+				return nextAdvance(chunk);
+		}
+	}
+	return nullptr;
+}
+
+void generateChunk(chunk_t *target) {
+	chunk_t *chunk;
+	while ((chunk = nextAdvance(target)))
+		chunk->advance();
+}
+
+tile_id chunk_t::dominant(int x, int y, int size) {
+	unsigned short counts[TILE_COUNT] = {0};
+	for (int i = x; i < x + size; i++)
+		for (int j = y; j < y + size; j++)
+			if (tileMap[i][j].id < TILE_COUNT)
+				counts[tileMap[i][j].id]++;
+	
+	//ties go to the solid tile so thin features survive zooming out
+	tile_id best = 0;
+	for (int i = 1; i < TILE_COUNT; i++)
+		if (counts[i] >= counts[best])
+			best = i;
+	return best;
+}
+
+void chunk_t::buildSummary() {
+	for (int i = 0; i < TILE_COUNT; i++)
+		tileCount[i] = 0;
+	for (int x = 0; x < chunkSize; x++)
+		for (int y = 0; y < chunkSize; y++)
+			if (tileMap[x][y].id < TILE_COUNT)
+				tileCount[tileMap[x][y].id]++;
+	
+	for (int x = 0; x < chunkSize / 2; x++)
+		for (int y = 0; y < chunkSize / 2; y++)
+			lod2[x][y] = dominant(x * 2, y * 2, 2);
+	for (int x = 0; x < chunkSize / 4; x++)
+		for (int y = 0; y < chunkSize / 4; y++)
+			lod4[x][y] = dominant(x * 4, y * 4, 4);
+	lod16 = dominant(0, 0, chunkSize);
+	
+	solidRows = 0;
+	for (int y = 0; y < chunkSize; y++) {
+		solid[y] = 0;
+		for (int x = 0; x < chunkSize; x++)
+			if (tileMap[x][y].id != air->id)
+				solid[y] |= 1 << x;
+		if (solid[y])
+			solidRows |= 1 << y;
+	}
+}
+
+void chunk_t::updateSummary(int x, int y, tile_id old) {
+	tile_id id = tileMap[x][y].id;
+	if (old < TILE_COUNT && tileCount[old] > 0)
+		tileCount[old]--;
+	if (id < TILE_COUNT)
+		tileCount[id]++;
+	
+	lod2[x / 2][y / 2] = dominant(x & ~1, y & ~1, 2);
+	lod4[x / 4][y / 4] = dominant(x & ~3, y & ~3, 4);
+	
+	if (id != air->id)
+		solid[y] |= 1 << x;
+	else
+		solid[y] &= ~(1 << x);
+	if (solid[y])
+		solidRows |= 1 << y;
+	else
+		solidRows &= ~(1 << y);
+	
+	tile_id best = 0;
+	for (int i = 1; i < TILE_COUNT; i++)
+		if (tileCount[i] >= tileCount[best])
+			best = i;
+	lod16 = best;
+}
+
+tile_id chunk_t::getSummary(int level, int x, int y) {
+	switch (level) {
+		case 2: return lod2[x][y];
+		case 4: return lod4[x][y];
+		case 16: return lod16;
+	}
+	return tileMap[x][y].id;
+}
+
+//average opaque color of each tile's texture, used when drawing summaries
+ch_co_t tileColor[TILE_COUNT];
+
+//average of the opaque pixels in a block of atlas cells, false if there are none
+bool atlasAverage(int ax, int ay, int w, int h, pixel *out) {
+	int r = 0, g = 0, b = 0, n = 0;
+	for (int x = 0; x < w * textureSize; x++) {
+		for (int y = 0; y < h * textureSize; y++) {
+			pixel pix = sampleImage(float(ax * textureSize + x) / textureWidth, float(ay * textureSize + y) / textureHeight);
+			if (pix.a < 255)
+				continue;
+			r += pix.r;
+			g += pix.g;
+			b += pix.b;
+			n++;
+		}
+	}
+	if (!n)
+		return false;
+	*out = pixel(r / n, g / n, b / n);
+	return true;
+}
+
+void buildTileColors() {
+	for (int i = 0; i < TILE_COUNT; i++) {
+		tile *t = tiles::tileRegistry[i];
+		tileColor[i].ch = ' ';
+		tileColor[i].co = 0;
+		tileColor[i].a = 0;
+		pixel average;
+		if (!t || t == air || !atlasAverage(t->textureAtlas[0], t->textureAtlas[1], 1, 1, &average))
+			continue;
+		
+		tileColor[i] = lutLookup(average.r, average.g, average.b, 255, textureTint);
+	}
+}
+
+//summary block size to draw at the current scale, 1 means draw tiles
+int lodLevel() {
+	if (scale >= lodScale)
+		return 1;
+	if (2 * scale >= 1.0f)
+		return 2;
+	if (4 * scale >= 1.0f)
+		return 4;
+	return 16;
+}
+
+void drawSummaries(canvas *cv, int level) {
+	double  width = 2 * scale;
+	double height = 1 * scale;
+	
+	int tx0 = floor(-viewX), ty0 = floor(-viewY + cv->y0 / height);
+	int tx1 = ceil(-viewX + frameWidth / width), ty1 = ceil(-viewY + cv->y1 / height);
+	int cx0 = std::max(tx0 / chunkSize, 0), cy0 = std::max(ty0 / chunkSize, 0);
+	int cx1 = std::min(tx1 / chunkSize, chunkCountX - 1), cy1 = std::min(ty1 / chunkSize, chunkCountY - 1);
+	int blocks = chunkSize / level;
+	
+	for (int cx = cx0; cx <= cx1; cx++) {
+		for (int cy = cy0; cy <= cy1; cy++) {
+			chunk_t *chunk = world->getChunk(cx, cy);
+			if (chunk->stage < GEN_FINALIZED)
+				continue;
+			for (int bx = 0; bx < blocks; bx++) {
+				for (int by = 0; by < blocks; by++) {
+					tile_id id = chunk->getSummary(level, bx, by);
+					if (id >= TILE_COUNT || tileColor[id].a < 255)
+						continue;
+					
+					double tx = cx * chunkSize + bx * level + viewX;
+					double ty = cy * chunkSize + by * level + viewY;
+					int x0 = floor(tx * width), x1 = floor((tx + level) * width);
+					int y0 = floor(ty * height), y1 = floor((ty + level) * height);
+					if (x1 < 0 || y1 < cv->y0 || x0 >= frameWidth || y0 >= cv->y1)
+						continue;
+					
+					cv->drawCalls++;
+					ch_co_t chco = tileColor[id];
+					for (int x = std::max(x0, 0); x < std::min(x1, frameWidth); x++) {
+						for (int y = std::max(y0, cv->y0); y < std::min(y1, cv->y1); y++) {
+							cv->pixelsDrawn++;
+							cv->write(x, y, chco.ch, chco.co);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+//Chunk pool
+
+//chunks come back as they were freed, generation overwrites every tile anyway
+chunk_t *chunkPool::alloc() {
+	while (true) {
+		unsigned long long old = head.load(std::memory_order_acquire);
+		unsigned int index = old & 0xffffffff;
+		if (!index) {
+			if (!grow())
+				return nullptr;
+			continue;
+		}
+		unsigned long long desired = (((old >> 32) + 1) << 32) | nextOf(index - 1).load(std::memory_order_relaxed);
+		if (head.compare_exchange_weak(old, desired, std::memory_order_acq_rel)) {
+			int count = ++live;
+			int highest = peak;
+			while (count > highest && !peak.compare_exchange_weak(highest, count));
+			return at(index - 1);
+		}
+	}
+}
+
+void chunkPool::free(chunk_t *chunk) {
+	unsigned int index = chunk->poolIndex;
+	unsigned long long old = head.load(std::memory_order_relaxed);
+	do {
+		nextOf(index).store(old & 0xffffffff, std::memory_order_relaxed);
+	} while (!head.compare_exchange_weak(old, (((old >> 32) + 1) << 32) | (index + 1), std::memory_order_release, std::memory_order_relaxed));
+	live--;
+}
+
+bool chunkPool::grow() {
+	std::lock_guard<std::mutex> guard(growLock);
+	if (head.load() & 0xffffffff)
+		return true;
+	unsigned int n = slabCount;
+	if (n >= (unsigned int)maxBlocks * slabsPerBlock)
+		return false;
+	if (!blocks[n / slabsPerBlock].load())
+		blocks[n / slabsPerBlock].store(new slab*[slabsPerBlock], std::memory_order_release);
+	
+	size_t bytes = (sizeof(slab) + slabBytes - 1) / slabBytes * slabBytes;
+	void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return false;
+#ifdef MADV_HUGEPAGE
+	if (hugePages)
+		madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+	
+	slab *s = new (memory) slab;
+	for (int i = 0; i < slabChunks; i++) {
+		s->chunks[i].poolIndex = n * slabChunks + i;
+		s->next[i] = i + 1 < slabChunks ? n * slabChunks + i + 2 : 0;
+	}
+	blocks[n / slabsPerBlock].load()[n % slabsPerBlock] = s;
+	slabCount = n + 1;
+	
+	//splice the new slab's chain in front of whatever was freed meanwhile
+	unsigned int last = n * slabChunks + slabChunks - 1;
+	unsigned long long old = head.load();
+	do {
+		nextOf(last).store(old & 0xffffffff);
+	} while (!head.compare_exchange_weak(old, (((old >> 32) + 1) << 32) | (n * slabChunks + 1)));
+	return true;
+}
+
+//for callers that cannot go on without the chunk
+chunk_t *allocChunk() {
+	chunk_t *chunk = chunkpool.alloc();
+	if (!chunk) {
+		fprintf(stderr, "out of memory for chunks, %d live\n", int(chunkpool.live));
+		exit(1);
+	}
+	return chunk;
+}
+
+void chunk_t::clear() {
+	for (int x = 0; x < chunkSize; x++)
+		for (int y = 0; y < chunkSize; y++)
+			tileMap[x][y] = air->getDefaultState();
+}
+
+//Worker pool
+
+void workerPool::start(int count) {
+	running = true;
+	generation = 0;
+	busy = 0;
+	for (int i = 0; i < count; i++)
+		threads.emplace_back(&workerPool::run, this);
+}
+
+void workerPool::run() {
+	unsigned int seen = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [&] { return !running || generation != seen; });
+			if (!running)
+				return;
+			seen = generation;
+		}
+		work();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (--busy == 0)
+				done.notify_all();
+		}
+	}
+}
+
+void workerPool::work() {
+	int i;
+	while ((i = next++) < count)
+		job(i);
+}
+
+//runs job(0..count-1) across the pool and the calling thread, not reentrant
+void workerPool::parallelFor(int count, const std::function<void(int)> &job) {
+	if (threads.empty() || count <= 1) {
+		for (int i = 0; i < count; i++)
+			job(i);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		this->job = job;
+		this->count = count;
+		next = 0;
+		busy = threads.size();
+		generation++;
+		wake.notify_all();
+	}
+	work();
+	std::unique_lock<std::mutex> guard(lock);
+	done.wait(guard, [&] { return busy == 0; });
+}
+
+void startWorkers() {
+	if (!workers) {
+		workers = new workerPool;
+		workers->start(std::max(int(std::thread::hardware_concurrency()) - 1, 0));
+	}
+}
+
+//every stage runs in parallel, decoration in nine passes so no two writers share a chunk
+void generateWorld(const std::function<int(chunk_t*)> &target) {
+	for (int stage = GEN_TERRAIN; stage <= GEN_FINALIZED; stage++) {
+		int phases = stage == GEN_DECORATED ? 9 : 1;
+		for (int phase = 0; phase < phases; phase++) {
+			std::vector<chunk_t*> ready;
+			for (int i = 0; i < chunkCountX * chunkCountY; i++) {
+				chunk_t *chunk = world->chunks[i];
+				if (phases > 1 && (chunk->originX % 3) + (chunk->originY % 3) * 3 != phase)
+					continue;
+				if (chunk->stage == stage - 1 && stage <= target(chunk) && chunk->canAdvance())
+					ready.push_back(chunk);
+			}
+			workers->parallelFor(ready.size(), [&](int i) {
+				ready[i]->advance();
+			});
+		}
+	}
+}
+
+void generateWorld() {
+	generateWorld([](chunk_t*) { return int(GEN_FINALIZED); });
+}
+
+//Task scheduler
+
+void taskScheduler::submit(const char *name, int priority, std::function<bool()> step) {
+	tasks.push_back({ name, priority, step, 0.0f, 0 });
+}
+
+void taskScheduler::cancel(const char *name) {
+	for (size_t i = 0; i < tasks.size(); i++)
+		if (!strcmp(tasks[i].name, name))
+			tasks.erase(tasks.begin() + i--);
+}
+
+//highest priority first, longest waiting among equals
+int taskScheduler::pick() {
+	int best = -1;
+	for (int i = 0; i < (int)tasks.size(); i++)
+		if (best < 0 || tasks[i].priority > tasks[best].priority || (tasks[i].priority == tasks[best].priority && tasks[i].lastRun < tasks[best].lastRun))
+			best = i;
+	return best;
+}
+
+void taskScheduler::runStep(int i) {
+	auto tp1 = std::chrono::steady_clock::now();
+	bool more = tasks[i].step();
+	auto tp2 = std::chrono::steady_clock::now();
+	tasks[i].cost = tasks[i].cost * 0.75f + std::chrono::duration<float, std::micro>(tp2 - tp1).count() * 0.25f;
+	tasks[i].lastRun = ++stepCount;
+	if (!more)
+		tasks.erase(tasks.begin() + i);
+}
+
+//only starts a step when its usual cost still fits before the deadline
+int taskScheduler::run(std::chrono::steady_clock::time_point deadline) {
+	int steps = 0;
+	while (tasks.size()) {
+		int i = pick();
+		if (std::chrono::steady_clock::now() + std::chrono::microseconds(int(tasks[i].cost)) >= deadline)
+			break;
+		runStep(i);
+		steps++;
+	}
+	return steps;
+}
+
+//replays run exactly as many steps as were recorded
+int taskScheduler::runSteps(int count) {
+	int steps = 0;
+	for (; steps < count && tasks.size(); steps++)
+		runStep(pick());
+	return steps;
+}
+
+//finalizes chunks nearest to the given chunk first, one chunk stage per step
+//generation does not depend on order, so this builds the same world as generateWorld
+void submitGeneration(int cx, int cy) {
+	std::vector<chunk_t*> order(world->chunks, world->chunks + chunkCountX * chunkCountY);
+	std::stable_sort(order.begin(), order.end(), [&](chunk_t *a, chunk_t *b) {
+		return std::max(abs(a->originX - cx), abs(a->originY - cy)) < std::max(abs(b->originX - cx), abs(b->originY - cy));
+	});
+	size_t pos = 0;
+	scheduler.submit("generate", 1, [order, pos]() mutable {
+		while (pos < order.size() && order[pos]->stage >= GEN_FINALIZED)
+			pos++;
+		if (pos >= order.size())
+			return false;
+		nextAdvance(order[pos])->advance();
+		return true;
+	});
 }
 
 void init() {
-	srand(time(NULL));
+	srand(worldSeed);
 	
 	viewX = 0;
 	viewY = 0;
@@ -574,15 +1551,23 @@ void init() {
 	playerY = 25.0f;
 	playerYvelocity = 0;
 	
+	scheduler.cancel("generate");
+	
 	if (world) {
-		if (world->chunks)
+		if (world->chunks) {
+			for (int i = 0; i < chunkCountPrev; i++)
+				chunkpool.free(world->chunks[i]);
 			delete [] world->chunks;
+		}
 		delete world;
 	}
 	
 	world = new world_t;
 	//world->tileMap = new tileState[tileMapWidth * tileMapHeight];
-	world->chunks = new chunk_t[chunkCountX * chunkCountY];
+	world->chunks = new chunk_t*[chunkCountX * chunkCountY];
+	for (int i = 0; i < chunkCountX * chunkCountY; i++)
+		world->chunks[i] = allocChunk();
+	chunkCountPrev = chunkCountX * chunkCountY;
 	
 	/*
 	for (int y = 0; y < tileMapHeight; y++) {
@@ -599,20 +1584,44 @@ void init() {
 	}
 	*/	
 	
+	startWorkers();
+	
 	for (int x = 0; x < chunkCountX; x++) {
 		for (int y = 0; y < chunkCountY; y++) {
-			chunk_t *currentChunk = &world->chunks[y * chunkCountX + x];
+			chunk_t *currentChunk = world->chunks[y * chunkCountX + x];
 			currentChunk->originX = x;
 			currentChunk->originY = y;
-			currentChunk->generate();
+			currentChunk->stage = GEN_NONE;
+			//clients start empty and are filled in by the server
+			if (client) {
+				currentChunk->clear();
+				currentChunk->buildSummary();
+				currentChunk->stage = GEN_FINALIZED;
+			}
 		}
 	}
 	
-	for (int x = 0; x < chunkCountX * chunkSize; x++) {
-		for (int y = 0; y < chunkCountY * chunkSize; y++) {
-			tileComplete cmp = world->getComplete(x,y);
-			cmp.parent->onUpdate(&cmp, x, y);
-		}
+	if (!paths) {
+		paths = new pathfinder;
+		paths->start();
+	}
+	paths->reset();
+	
+	//the spawn area right away, the rest of the world in idle frame time
+	if (!client) {
+		int cx = std::min(std::max(int(-playerX) / chunkSize, 0), chunkCountX - 1);
+		int cy = std::min(std::max(int(-playerY) / chunkSize, 0), chunkCountY - 1);
+		for (int x = cx - 1; x <= cx + 1; x++)
+			for (int y = cy - 1; y <= cy + 1; y++)
+				if (world->getChunk(x, y))
+					generateChunk(world->getChunk(x, y));
+		submitGeneration(cx, cy);
+	}
+	
+	if (client) {
+		client->viewX = client->viewY = -1;
+		client->resync();
+		return;
 	}
 	
 	/*
@@ -625,57 +1634,1191 @@ void init() {
 	*/
 }
 
-void display() {
-	{		
-		int width = 2 * scale;
-		int height = 1 * scale;
-		for (int x = 0; x < adv::width; x++) {
-			for (int y = 0; y < adv::height; y++) {
-				adv::write(x,y,'#', FGREEN | BBLACK);
-			}
-		}
-	}
-	
+//Networking
+
+//runtime options come from the environment since wmain takes no arguments
+const char *getOption(const char *name) {
+	char buf[64];
+	snprintf(&buf[0], 63, "OW2D_%s", name);
+	return getenv(&buf[0]);
+}
+
+int getOptionInt(const char *name, int def) {
+	const char *value = getOption(name);
+	return value ? atoi(value) : def;
+}
+
+enum netMessage : unsigned char {
+	MSG_VIEW = 1,	//client: chunk x, chunk y, view distance
+	MSG_PLACE,		//client: x, y, tile state
+	MSG_RESYNC,		//client: forget what was sent, resend the view
+	MSG_WORLD,		//server: chunk count x, chunk count y
+	MSG_CHUNK,		//server: chunk x, chunk y, rle tile states
+	MSG_DELTA,		//server: count, then x, y, tile state per changed tile
+};
+
+const int messageHeader = 5;
+//anything longer is a broken or hostile peer
+const int maxMessageBytes = 16 << 20;
+const int tileStateBytes = 5;
+
+void putInt(std::string &buf, int v) {
+	buf.append((const char*)&v, 4);
+}
+
+int readInt(const char *p) {
+	int v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+void putState(std::string &buf, tileState state) {
+	buf.push_back(state.id);
+	buf.append((const char*)&state.data.b, 4);
+}
+
+tileState readState(const char *p) {
+	tileState state;
+	state.id = p[0];
+	memcpy(&state.data.b, p + 1, 4);
+	return state;
+}
+
+void putMessage(std::string &buf, unsigned char type, const std::string &payload) {
+	buf.push_back(type);
+	putInt(buf, payload.size());
+	buf.append(payload);
+}
+
+//runs of up to 255 identical states, column by column
+void compressChunk(chunk_t *chunk, std::string &out) {
+	tileState *tiles = &chunk->tileMap[0][0];
+	int count = chunkSize * chunkSize;
+	for (int i = 0; i < count;) {
+		int run = 1;
+		while (i + run < count && run < 255 && tiles[i + run].id == tiles[i].id && tiles[i + run].data.b == tiles[i].data.b)
+			run++;
+		out.push_back((unsigned char)run);
+		putState(out, tiles[i]);
+		i += run;
+	}
+}
+
+bool decompressChunk(const char *p, int len, chunk_t *chunk) {
+	tileState *tiles = &chunk->tileMap[0][0];
+	int count = chunkSize * chunkSize;
+	int i = 0;
+	for (int j = 0; j + 1 + tileStateBytes <= len; j += 1 + tileStateBytes) {
+		int run = (unsigned char)p[j];
+		tileState state = readState(p + j + 1);
+		if (i + run > count)
+			return false;
+		while (run--)
+			tiles[i++] = state;
+	}
+	return i == count;
+}
+
+//a numeric address is a loopback tcp port, anything else a unix socket path
+int openSocket(const char *address, bool listening) {
+	bool tcp = strspn(address, "0123456789") == strlen(address);
+	int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	
+	int result;
+	if (tcp) {
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(address));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (listening) {
+			int yes = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			result = bind(fd, (sockaddr*)&addr, sizeof(addr));
+		} else {
+			result = ::connect(fd, (sockaddr*)&addr, sizeof(addr));
+		}
+	} else {
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, address, sizeof(addr.sun_path) - 1);
+		if (listening) {
+			unlink(address);
+			result = bind(fd, (sockaddr*)&addr, sizeof(addr));
+		} else {
+			result = ::connect(fd, (sockaddr*)&addr, sizeof(addr));
+		}
+	}
+	
+	if (result < 0 || (listening && ::listen(fd, 16) < 0)) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+//reads what is available, false once the peer is gone
+bool readSocket(int fd, std::string &in) {
+	char buf[4096];
+	while (true) {
+		int n = recv(fd, &buf[0], sizeof(buf), 0);
+		if (n > 0) {
+			in.append(&buf[0], n);
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n < 0 && errno == EINTR)
+			continue;
+		return false;
+	}
+}
+
+bool writeSocket(int fd, std::string &out, long long *sent = nullptr) {
+	while (out.size()) {
+		int n = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		out.erase(0, n);
+		if (sent)
+			*sent += n;
+	}
+	return true;
+}
+
+//splits complete messages off the front of the buffer, false on a bad length
+template<typename F>
+bool readMessages(std::string &in, F handler) {
+	size_t pos = 0;
+	while (in.size() - pos >= messageHeader) {
+		int len = readInt(in.data() + pos + 1);
+		if (len < 0 || len > maxMessageBytes)
+			return false;
+		if (in.size() - pos - messageHeader < (size_t)len)
+			break;
+		handler((unsigned char)in[pos], in.data() + pos + messageHeader, len);
+		pos += messageHeader + len;
+	}
+	in.erase(0, pos);
+	return true;
+}
+
+bool chunkServer::listen(const char *address) {
+	fd = openSocket(address, true);
+	return fd >= 0;
+}
+
+void chunkServer::onPlace(int x, int y) {
+	//the placed tile and the neighbors its updates may have reconnected
+	int offsets[][2] = { {0,0}, {0,-1}, {1,0}, {0,1}, {-1,0} };
+	for (auto &o : offsets) {
+		int tx = x + o[0], ty = y + o[1];
+		if (tx < 0 || ty < 0 || tx >= tileMapWidth || ty >= tileMapHeight)
+			continue;
+		edits.push_back(((long long)ty << 32) | (unsigned int)tx);
+	}
+}
+
+void chunkServer::accept() {
+	int cfd;
+	while ((cfd = ::accept(fd, nullptr, nullptr)) >= 0) {
+		fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+		chunkConsumer *consumer = new chunkConsumer;
+		consumer->fd = cfd;
+		consumer->setPosition(0, 0);
+		consumer->setDistance(-1);
+		consumer->subscribed.assign(chunkCountX * chunkCountY, false);
+		
+		std::string payload;
+		putInt(payload, chunkCountX);
+		putInt(payload, chunkCountY);
+		putMessage(consumer->out, MSG_WORLD, payload);
+		consumers.push_back(consumer);
+	}
+}
+
+bool chunkServer::receive(chunkConsumer *consumer) {
+	bool alive = readSocket(consumer->fd, consumer->in);
+	return readMessages(consumer->in, [&](unsigned char type, const char *p, int len) {
+		handle(consumer, type, p, len);
+	}) && alive;
+}
+
+void chunkServer::handle(chunkConsumer *consumer, unsigned char type, const char *p, int len) {
+	switch (type) {
+		case MSG_VIEW:
+			if (len < 12)
+				break;
+			consumer->setPosition(readInt(p), readInt(p + 4));
+			consumer->setDistance(std::min(readInt(p + 8), std::max(chunkCountX, chunkCountY)));
+			subscribe(consumer);
+			break;
+		case MSG_PLACE:
+		{
+			if (len < 8 + tileStateBytes)
+				break;
+			int x = readInt(p), y = readInt(p + 4);
+			tileState state = readState(p + 8);
+			if (x < 0 || y < 0 || x >= tileMapWidth || y >= tileMapHeight || state.id >= tiles::id)
+				break;
+			world->place(x, y, state);
+		}
+			break;
+		case MSG_RESYNC:
+			consumer->subscribed.assign(chunkCountX * chunkCountY, false);
+			consumer->pending.clear();
+			subscribe(consumer);
+			break;
+	}
+}
+
+void chunkServer::subscribe(chunkConsumer *consumer) {
+	for (int cy = 0; cy < chunkCountY; cy++) {
+		for (int cx = 0; cx < chunkCountX; cx++) {
+			int i = cy * chunkCountX + cx;
+			bool view = consumer->inView(cx, cy);
+			if (view && !consumer->subscribed[i])
+				consumer->pending.push_back(i);
+			consumer->subscribed[i] = view;
+		}
+	}
+	
+	//nearest first
+	std::sort(consumer->pending.begin(), consumer->pending.end(), [&](int a, int b) {
+		int da = std::max(abs(a % chunkCountX - consumer->x), abs(a / chunkCountX - consumer->y));
+		int db = std::max(abs(b % chunkCountX - consumer->x), abs(b / chunkCountX - consumer->y));
+		return da < db;
+	});
+}
+
+void chunkServer::sendDeltas() {
+	if (edits.empty())
+		return;
+	std::sort(edits.begin(), edits.end());
+	edits.erase(std::unique(edits.begin(), edits.end()), edits.end());
+	
+	for (chunkConsumer *consumer : consumers) {
+		std::string payload;
+		int count = 0;
+		putInt(payload, 0);
+		for (long long edit : edits) {
+			int x = edit & 0xffffffff, y = edit >> 32;
+			if (!consumer->subscribed[(y / chunkSize) * chunkCountX + (x / chunkSize)])
+				continue;
+			putInt(payload, x);
+			putInt(payload, y);
+			putState(payload, *world->getState(x, y));
+			count++;
+		}
+		if (!count)
+			continue;
+		memcpy(&payload[0], &count, 4);
+		putMessage(consumer->out, MSG_DELTA, payload);
+	}
+	edits.clear();
+}
+
+void chunkServer::sendChunks(chunkConsumer *consumer) {
+	int sent = 0;
+	for (size_t j = 0; j < consumer->pending.size() && sent < maxChunksPerTick && (int)consumer->out.size() < maxBufferedBytes; j++) {
+		int i = consumer->pending[j];
+		if (consumer->subscribed[i] && world->chunks[i]->stage < GEN_FINALIZED)
+			continue;
+		consumer->pending.erase(consumer->pending.begin() + j--);
+		if (!consumer->subscribed[i])
+			continue;
+		
+		std::string payload;
+		putInt(payload, i % chunkCountX);
+		putInt(payload, i / chunkCountX);
+		compressChunk(world->chunks[i], payload);
+		putMessage(consumer->out, MSG_CHUNK, payload);
+		sent++;
+		chunksSent++;
+	}
+}
+
+bool chunkServer::flush(chunkConsumer *consumer) {
+	return writeSocket(consumer->fd, consumer->out, &bytesSent);
+}
+
+void chunkServer::tick() {
+	accept();
+	
+	for (size_t i = 0; i < consumers.size(); i++) {
+		if (!receive(consumers[i])) {
+			close(consumers[i]->fd);
+			delete consumers[i];
+			consumers.erase(consumers.begin() + i--);
+		}
+	}
+	
+	sendDeltas();
+	
+	for (size_t i = 0; i < consumers.size(); i++) {
+		sendChunks(consumers[i]);
+		if (!flush(consumers[i])) {
+			close(consumers[i]->fd);
+			delete consumers[i];
+			consumers.erase(consumers.begin() + i--);
+		}
+	}
+}
+
+bool chunkClient::connect(const char *address) {
+	fd = openSocket(address, false);
+	distance = getOptionInt("VIEW", 4);
+	return fd >= 0;
+}
+
+void chunkClient::setView(int cx, int cy) {
+	if (cx == viewX && cy == viewY)
+		return;
+	viewX = cx;
+	viewY = cy;
+	std::string payload;
+	putInt(payload, cx);
+	putInt(payload, cy);
+	putInt(payload, distance);
+	putMessage(out, MSG_VIEW, payload);
+}
+
+void chunkClient::place(int x, int y, tileState state) {
+	std::string payload;
+	putInt(payload, x);
+	putInt(payload, y);
+	putState(payload, state);
+	putMessage(out, MSG_PLACE, payload);
+}
+
+void chunkClient::resync() {
+	putMessage(out, MSG_RESYNC, std::string());
+}
+
+void chunkClient::poll() {
+	if (fd < 0)
+		return;
+	if (!writeSocket(fd, out) || !readSocket(fd, in)) {
+		close(fd);
+		fd = -1;
+	}
+	bool valid = readMessages(in, [&](unsigned char type, const char *p, int len) {
+		handle(type, p, len);
+	});
+	if (!valid && fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+void chunkClient::handle(unsigned char type, const char *p, int len) {
+	switch (type) {
+		case MSG_WORLD:
+			if (len < 8)
+				break;
+			if (readInt(p) != chunkCountX || readInt(p + 4) != chunkCountY) {
+				chunkCountX = readInt(p);
+				chunkCountY = readInt(p + 4);
+				tileMapWidth = chunkCountX * chunkSize;
+				tileMapHeight = chunkCountY * chunkSize;
+				init();
+			}
+			break;
+		case MSG_CHUNK:
+		{
+			if (len < 8)
+				break;
+			chunk_t *chunk = world->getChunk(readInt(p), readInt(p + 4));
+			if (chunk && decompressChunk(p + 8, len - 8, chunk)) {
+				chunk->stage = GEN_FINALIZED;
+				chunk->buildSummary();
+				if (paths)
+					paths->onChunk(chunk);
+			}
+		}
+			break;
+		case MSG_DELTA:
+		{
+			if (len < 4)
+				break;
+			int count = readInt(p);
+			const char *e = p + 4;
+			for (int i = 0; i < count && e + 8 + tileStateBytes <= p + len; i++, e += 8 + tileStateBytes) {
+				int x = readInt(e), y = readInt(e + 4);
+				if (x >= 0 && y >= 0 && x < tileMapWidth && y < tileMapHeight)
+					world->set(x, y, readState(e + 8));
+			}
+		}
+			break;
+	}
+}
+
+//edits go through the server when connected to one
+void placeTile(int x, int y, tileState state) {
+	chunk_t *chunk = (x >= 0 && y >= 0) ? world->getChunk(x / chunkSize, y / chunkSize) : nullptr;
+	if (chunk && chunk->stage < GEN_FINALIZED)
+		return;
+	if (client)
+		client->place(x, y, state);
+	else
+		world->place(x, y, state);
+}
+
+//Raycasting
+
+struct ray {
+	float x, y;
+	float dx, dy;
+	float length;
+};
+
+struct rayHit {
+	bool hit;
+	int x, y;
+	float distance;
+	int normalX, normalY;	//side the tile was entered through, zero if the ray started inside it
+};
+
+//grid crossings at start, start + 1 / rate... up to t, at most n
+int crossings(float start, float rate, float t, int n) {
+	if (start > t)
+		return 0;
+	return std::min(int((t - start) * rate) + 1, n);
+}
+
+//grid walk over the chunk bitmaps, runs of empty rows and whole empty chunks are crossed in one jump
+//unfinished chunks end the ray like the edge of the world
+bool raycast(const ray &r, rayHit *hit) {
+	hit->hit = false;
+	float len = sqrtf(r.dx * r.dx + r.dy * r.dy);
+	if (len == 0 || r.x < 0 || r.y < 0)
+		return false;
+	float dx = r.dx / len, dy = r.dy / len;
+	
+	int ix = int(r.x), iy = int(r.y);
+	int stepX = dx > 0 ? 1 : (dx < 0 ? -1 : 0);
+	int stepY = dy > 0 ? 1 : (dy < 0 ? -1 : 0);
+	float deltaX = stepX ? fabsf(1.0f / dx) : INFINITY;
+	float deltaY = stepY ? fabsf(1.0f / dy) : INFINITY;
+	float maxX = stepX > 0 ? (ix + 1 - r.x) * deltaX : (stepX < 0 ? (r.x - ix) * deltaX : INFINITY);
+	float maxY = stepY > 0 ? (iy + 1 - r.y) * deltaY : (stepY < 0 ? (r.y - iy) * deltaY : INFINITY);
+	float t = 0;
+	int normalX = 0, normalY = 0;
+	
+	chunk_t *chunk = nullptr;
+	int cx = -1, cy = -1;
+	while (t <= r.length && ix >= 0 && iy >= 0) {
+		if (ix / chunkSize != cx || iy / chunkSize != cy) {
+			cx = ix / chunkSize;
+			cy = iy / chunkSize;
+			chunk = world->getChunk(cx, cy);
+			if (!chunk || chunk->stage < GEN_FINALIZED)
+				return false;
+		}
+		int x0 = chunk->originX * chunkSize, y0 = chunk->originY * chunkSize;
+		int lx = ix - x0, ly = iy - y0;
+		
+		//tile by tile through rows with anything solid in them
+		if (chunk->solid[ly]) {
+			if (chunk->solid[ly] >> lx & 1) {
+				hit->x = ix;
+				hit->y = iy;
+				hit->distance = t;
+				hit->normalX = normalX;
+				hit->normalY = normalY;
+				hit->hit = true;
+				return true;
+			}
+			if (maxX < maxY) {
+				t = maxX;
+				maxX += deltaX;
+				ix += stepX;
+				normalX = -stepX;
+				normalY = 0;
+			} else {
+				t = maxY;
+				maxY += deltaY;
+				iy += stepY;
+				normalX = 0;
+				normalY = -stepY;
+			}
+			continue;
+		}
+		
+		//an empty row, jump to the next solid row found with a bit scan or out of the chunk
+		int nx = stepX > 0 ? chunkSize - 1 - lx : lx;
+		int ny = 0;
+		if (stepY > 0) {
+			unsigned int ahead = chunk->solidRows & ~((2u << ly) - 1);
+			ny = (ahead ? __builtin_ctz(ahead) : chunkSize) - ly - 1;
+		} else if (stepY < 0) {
+			unsigned int ahead = chunk->solidRows & ((1u << ly) - 1);
+			ny = ly - (ahead ? 31 - __builtin_clz(ahead) : -1) - 1;
+		}
+		float exitX = stepX ? maxX + nx * deltaX : INFINITY;
+		float exitY = stepY ? maxY + ny * deltaY : INFINITY;
+		bool leaveX = exitX < exitY;
+		int kx = leaveX ? nx + 1 : crossings(maxX, fabsf(dx), exitY, nx);
+		int ky = leaveX ? crossings(maxY, fabsf(dy), exitX, ny) : ny + 1;
+		ix += stepX * kx;
+		iy += stepY * ky;
+		//a zero step count must leave an infinite delta alone rather than turn it into a NaN
+		if (kx)
+			maxX += deltaX * kx;
+		if (ky)
+			maxY += deltaY * ky;
+		normalX = leaveX ? -stepX : 0;
+		normalY = leaveX ? 0 : -stepY;
+		t = leaveX ? exitX : exitY;
+	}
+	return false;
+}
+
+//rays for many entities at once, spread over the worker pool in blocks
+void raycast(const ray *rays, rayHit *hits, int count) {
+	const int block = 256;
+	if (!workers || count <= block) {
+		for (int i = 0; i < count; i++)
+			raycast(rays[i], &hits[i]);
+		return;
+	}
+	workers->parallelFor((count + block - 1) / block, [&](int b) {
+		for (int i = b * block; i < std::min(count, (b + 1) * block); i++)
+			raycast(rays[i], &hits[i]);
+	});
+}
+
+bool lineOfSight(float x0, float y0, float x1, float y1) {
+	ray r = { x0, y0, x1 - x0, y1 - y0, sqrtf((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0)) };
+	rayHit hit;
+	return !raycast(r, &hit);
+}
+
+//a tile is in reach when it is close enough and nothing solid is in the way
+bool canReach(int x, int y) {
+	float px = -playerX, py = -playerY + 0.5f;
+	ray r = { px, py, x + 0.5f - px, y + 0.5f - py, 0 };
+	r.length = sqrtf(r.dx * r.dx + r.dy * r.dy);
+	if (r.length > reach)
+		return false;
+	//digging out when stuck inside the terrain
+	tileComplete inside = world->getComplete(px, py);
+	if (inside.parent->id != air->id)
+		return true;
+	rayHit hit;
+	return !raycast(r, &hit) || (hit.x == x && hit.y == y);
+}
+
+//Pathfinding
+
+unsigned short solidRow(chunk_t *chunk, int y) {
+	return chunk->solid[y];
+}
+
+void pathfinder::start() {
+	running = true;
+	version = 0;
+	solved = 0;
+	worker = std::thread(&pathfinder::run, this);
+}
+
+void pathfinder::stop() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		running = false;
+		wake.notify_one();
+	}
+	worker.join();
+}
+
+//snapshots the whole world, the worker never reads chunks directly
+void pathfinder::reset() {
+	std::lock_guard<std::mutex> guard(lock);
+	resetX = chunkCountX;
+	resetY = chunkCountY;
+	incoming.assign(chunkCountX * chunkCountY * chunkSize, 0);
+	incomingRows.assign(chunkCountX * chunkCountY, 0);
+	incomingChunks.clear();
+	for (int c = 0; c < chunkCountX * chunkCountY; c++)
+		for (int y = 0; y < chunkSize; y++)
+			markRow(c, y, world->chunks[c]->stage >= GEN_FINALIZED ? solidRow(world->chunks[c], y) : (unsigned short)0);
+	wake.notify_one();
+}
+
+//caller holds the lock
+void pathfinder::markRow(int c, int y, unsigned short mask) {
+	if (c < 0 || c >= (int)incomingRows.size())
+		return;
+	incoming[c * chunkSize + y] = mask;
+	if (!incomingRows[c])
+		incomingChunks.push_back(c);
+	incomingRows[c] |= 1 << y;
+}
+
+void pathfinder::onPlace(int x, int y) {
+	int cx = x / chunkSize, cy = y / chunkSize;
+	chunk_t *chunk = world->getChunk(cx, cy);
+	std::lock_guard<std::mutex> guard(lock);
+	markRow(cy * chunkCountX + cx, y - cy * chunkSize, solidRow(chunk, y - cy * chunkSize));
+}
+
+void pathfinder::onChunk(chunk_t *chunk) {
+	int c = chunk->originY * chunkCountX + chunk->originX;
+	std::lock_guard<std::mutex> guard(lock);
+	for (int y = 0; y < chunkSize; y++)
+		markRow(c, y, solidRow(chunk, y));
+}
+
+//the request must stay alive until its state leaves PENDING
+void pathfinder::submit(pathRequest *request) {
+	request->state = pathRequest::PENDING;
+	std::lock_guard<std::mutex> guard(lock);
+	queue.push_back(request);
+	wake.notify_one();
+}
+
+int pathfinder::neighbor(int c, int dir) {
+	int cx = c % countX, cy = c / countX;
+	int offsets[][2] = { {0,-1}, {1,0}, {0,1}, {-1,0} };
+	cx += offsets[dir][0];
+	cy += offsets[dir][1];
+	if (cx < 0 || cy < 0 || cx >= countX || cy >= countY)
+		return -1;
+	return cy * countX + cx;
+}
+
+void pathfinder::run() {
+	std::vector<pathRequest*> batch;
+	std::vector<navEdit> pending;
+	
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [&] { return !running || queue.size() || resetX >= 0; });
+			if (!running)
+				return;
+			batch.swap(queue);
+			for (int c : incomingChunks) {
+				for (int y = 0; y < chunkSize; y++)
+					if (incomingRows[c] >> y & 1)
+						pending.push_back({ c, y, incoming[c * chunkSize + y] });
+				incomingRows[c] = 0;
+			}
+			incomingChunks.clear();
+			if (resetX >= 0) {
+				countX = resetX;
+				countY = resetY;
+				navChunk fresh = navChunk();
+				fresh.dirty = true;
+				chunks.assign(countX * countY, fresh);
+				resetX = resetY = -1;
+			}
+		}
+		
+		for (navEdit &edit : pending) {
+			if (edit.chunk >= (int)chunks.size() || chunks[edit.chunk].solid[edit.row] == edit.mask)
+				continue;
+			chunks[edit.chunk].solid[edit.row] = edit.mask;
+			chunks[edit.chunk].dirty = true;
+			for (int dir = 0; dir < 4; dir++)
+				if (neighbor(edit.chunk, dir) >= 0)
+					chunks[neighbor(edit.chunk, dir)].dirty = true;
+		}
+		pending.clear();
+		
+		bool changed = false;
+		for (int c = 0; c < (int)chunks.size(); c++) {
+			if (chunks[c].dirty) {
+				rebuild(c);
+				changed = true;
+			}
+		}
+		if (changed)
+			version++;
+		
+		//agents heading for the same goal share one field
+		std::sort(batch.begin(), batch.end(), [](pathRequest *a, pathRequest *b) {
+			return a->gy != b->gy ? a->gy < b->gy : a->gx < b->gx;
+		});
+		for (pathRequest *request : batch) {
+			bool found = solve(request);
+			solved++;
+			request->state = found ? pathRequest::FOUND : pathRequest::UNREACHABLE;
+		}
+		batch.clear();
+	}
+}
+
+//one portal in the middle of every open run along each border
+void pathfinder::rebuild(int c) {
+	navChunk &chunk = chunks[c];
+	chunk.dirty = false;
+	chunk.portals.clear();
+	
+	for (int dir = 0; dir < 4; dir++) {
+		int n = neighbor(c, dir);
+		if (n < 0)
+			continue;
+		navChunk &other = chunks[n];
+		int run = 0;
+		for (int i = 0; i <= chunkSize; i++) {
+			bool open = false;
+			int x = 0, y = 0;
+			if (i < chunkSize) {
+				switch (dir) {
+					case 0: x = i; y = 0; open = !other.blocked(i, chunkSize - 1); break;
+					case 1: x = chunkSize - 1; y = i; open = !other.blocked(0, i); break;
+					case 2: x = i; y = chunkSize - 1; open = !other.blocked(i, 0); break;
+					case 3: x = 0; y = i; open = !other.blocked(chunkSize - 1, i); break;
+				}
+				open = open && !chunk.blocked(x, y);
+			}
+			if (open) {
+				run++;
+				continue;
+			}
+			if (run) {
+				int mid = i - (run + 1) / 2;
+				navPortal portal;
+				portal.dir = dir;
+				portal.x = (dir == 0 || dir == 2) ? mid : (dir == 1 ? chunkSize - 1 : 0);
+				portal.y = (dir == 1 || dir == 3) ? mid : (dir == 2 ? chunkSize - 1 : 0);
+				if (chunk.portals.size() < maxPortals)
+					chunk.portals.push_back(portal);
+			}
+			run = 0;
+		}
+	}
+	
+	int count = chunk.portals.size();
+	chunk.cost.assign(count * count, -1);
+	std::vector<int> dist;
+	for (int i = 0; i < count; i++) {
+		localSearch(c, chunk.portals[i].y * chunkSize + chunk.portals[i].x, -1, &dist, nullptr);
+		for (int j = 0; j < count; j++)
+			chunk.cost[i * count + j] = dist[chunk.portals[j].y * chunkSize + chunk.portals[j].x];
+	}
+}
+
+//breadth first inside one chunk, fills distances and/or the tile path to a target
+int pathfinder::localSearch(int c, int from, int to, std::vector<int> *dist, std::vector<std::pair<int,int>> *path) {
+	navChunk &chunk = chunks[c];
+	int parent[chunkSize * chunkSize];
+	int queue[chunkSize * chunkSize];
+	for (int i = 0; i < chunkSize * chunkSize; i++)
+		parent[i] = -1;
+	if (dist)
+		dist->assign(chunkSize * chunkSize, -1);
+	
+	int head = 0, tail = 0;
+	queue[tail++] = from;
+	parent[from] = from;
+	if (dist)
+		(*dist)[from] = 0;
+	while (head < tail) {
+		int cur = queue[head++];
+		if (cur == to)
+			break;
+		int x = cur % chunkSize, y = cur / chunkSize;
+		int next[4][2] = { {x,y-1}, {x+1,y}, {x,y+1}, {x-1,y} };
+		for (auto &n : next) {
+			if (n[0] < 0 || n[1] < 0 || n[0] >= chunkSize || n[1] >= chunkSize || chunk.blocked(n[0], n[1]))
+				continue;
+			int i = n[1] * chunkSize + n[0];
+			if (parent[i] >= 0)
+				continue;
+			parent[i] = cur;
+			if (dist)
+				(*dist)[i] = (*dist)[cur] + 1;
+			queue[tail++] = i;
+		}
+	}
+	
+	if (to < 0 || parent[to] < 0)
+		return -1;
+	
+	int length = 0;
+	if (path) {
+		int ox = (c % countX) * chunkSize, oy = (c / countX) * chunkSize;
+		size_t start = path->size();
+		for (int i = to; ; i = parent[i]) {
+			path->push_back({ ox + i % chunkSize, oy + i / chunkSize });
+			if (i == from)
+				break;
+		}
+		std::reverse(path->begin() + start, path->end());
+		length = path->size() - start - 1;
+	}
+	return length;
+}
+
+//distance from every portal to the goal and the next portal along the way
+pathfinder::goalField *pathfinder::field(int gx, int gy) {
+	long long key = ((long long)gy << 32) | (unsigned int)gx;
+	auto it = fields.find(key);
+	if (it != fields.end() && it->second.version == version)
+		return &it->second;
+	if (fields.size() > 256)
+		fields.clear();
+	
+	goalField &f = fields[key];
+	f.version = version;
+	f.dist.assign(chunks.size() * maxPortals, -1);
+	f.next.assign(chunks.size() * maxPortals, -1);
+	
+	typedef std::pair<int,int> entry;
+	std::priority_queue<entry, std::vector<entry>, std::greater<entry>> open;
+	
+	int gc = (gy / chunkSize) * countX + (gx / chunkSize);
+	std::vector<int> dist;
+	localSearch(gc, (gy % chunkSize) * chunkSize + (gx % chunkSize), -1, &dist, nullptr);
+	for (int i = 0; i < (int)chunks[gc].portals.size(); i++) {
+		navPortal &portal = chunks[gc].portals[i];
+		int d = dist[portal.y * chunkSize + portal.x];
+		if (d < 0)
+			continue;
+		f.dist[gc * maxPortals + i] = d;
+		open.push({ d, gc * maxPortals + i });
+	}
+	
+	while (open.size()) {
+		entry e = open.top();
+		open.pop();
+		int node = e.second, c = node / maxPortals, i = node % maxPortals;
+		if (e.first > f.dist[node])
+			continue;
+		
+		auto relax = [&](int to, int cost) {
+			if (f.dist[to] >= 0 && f.dist[to] <= e.first + cost)
+				return;
+			f.dist[to] = e.first + cost;
+			f.next[to] = node;
+			open.push({ f.dist[to], to });
+		};
+		
+		navChunk &chunk = chunks[c];
+		int count = chunk.portals.size();
+		for (int j = 0; j < count; j++)
+			if (j != i && chunk.cost[i * count + j] >= 0)
+				relax(c * maxPortals + j, chunk.cost[i * count + j]);
+		
+		//the matching portal across the border
+		navPortal &portal = chunk.portals[i];
+		int n = neighbor(c, portal.dir);
+		int ox = portal.dir == 1 ? 0 : (portal.dir == 3 ? chunkSize - 1 : portal.x);
+		int oy = portal.dir == 2 ? 0 : (portal.dir == 0 ? chunkSize - 1 : portal.y);
+		for (int j = 0; j < (int)chunks[n].portals.size(); j++) {
+			navPortal &other = chunks[n].portals[j];
+			if (other.dir == (portal.dir + 2) % 4 && other.x == ox && other.y == oy)
+				relax(n * maxPortals + j, 1);
+		}
+	}
+	return &f;
+}
+
+bool pathfinder::solve(pathRequest *request) {
+	request->path.clear();
+	int sx = request->sx, sy = request->sy, gx = request->gx, gy = request->gy;
+	int width = countX * chunkSize, height = countY * chunkSize;
+	if (sx < 0 || sy < 0 || gx < 0 || gy < 0 || sx >= width || sy >= height || gx >= width || gy >= height)
+		return false;
+	
+	int sc = (sy / chunkSize) * countX + (sx / chunkSize);
+	int gc = (gy / chunkSize) * countX + (gx / chunkSize);
+	int from = (sy % chunkSize) * chunkSize + (sx % chunkSize);
+	int to = (gy % chunkSize) * chunkSize + (gx % chunkSize);
+	if (chunks[sc].blocked(sx % chunkSize, sy % chunkSize) || chunks[gc].blocked(gx % chunkSize, gy % chunkSize))
+		return false;
+	
+	if (sc == gc && localSearch(sc, from, to, nullptr, &request->path) >= 0)
+		return true;
+	
+	goalField *f = field(gx, gy);
+	std::vector<int> dist;
+	localSearch(sc, from, -1, &dist, nullptr);
+	int best = -1, bestCost = 0;
+	for (int i = 0; i < (int)chunks[sc].portals.size(); i++) {
+		navPortal &portal = chunks[sc].portals[i];
+		int d = dist[portal.y * chunkSize + portal.x];
+		int node = sc * maxPortals + i;
+		if (d < 0 || f->dist[node] < 0)
+			continue;
+		if (best < 0 || d + f->dist[node] < bestCost) {
+			best = node;
+			bestCost = d + f->dist[node];
+		}
+	}
+	if (best < 0)
+		return false;
+	
+	//refine each abstract step back into tiles
+	std::vector<std::pair<int,int>> &path = request->path;
+	auto append = [&](int c, int a, int b) {
+		std::vector<std::pair<int,int>> leg;
+		localSearch(c, a, b, nullptr, &leg);
+		path.insert(path.end(), leg.begin() + (path.empty() ? 0 : 1), leg.end());
+	};
+	auto tileOf = [&](int node) {
+		navPortal &portal = chunks[node / maxPortals].portals[node % maxPortals];
+		return portal.y * chunkSize + portal.x;
+	};
+	
+	append(sc, from, tileOf(best));
+	int node = best;
+	while (f->next[node] >= 0) {
+		int next = f->next[node];
+		if (next / maxPortals == node / maxPortals) {
+			append(node / maxPortals, tileOf(node), tileOf(next));
+		} else {
+			int c = next / maxPortals, t = tileOf(next);
+			path.push_back({ (c % countX) * chunkSize + t % chunkSize, (c / countX) * chunkSize + t / chunkSize });
+		}
+		node = next;
+	}
+	append(gc, tileOf(node), to);
+	return true;
+}
+
+void tickPhysics(float elapsedTimef) {
+	//hold the player still until the ground below has been generated
+	chunk_t *chunk = (playerX <= 0 && playerY <= 0) ? world->getChunk(int(-playerX) / chunkSize, int(-playerY) / chunkSize) : nullptr;
+	if (chunk && chunk->stage < GEN_FINALIZED)
+		return;
+	
+	playerYvelocity = playerYvelocity + (gravity * (1.0f/elapsedTimef));
+	
+	grounded = true;
+	//collision check
+	tileComplete below1 = world->getComplete(-playerX + 0.4f, -playerY+1);
+	tileComplete below2 = world->getComplete(-playerX - 0.4f, -playerY+1);
+	tileComplete physicsFrame1 = world->getComplete(-playerX + 0.4f, -(playerY + (playerYvelocity * (1.0f / elapsedTimef))) + 1);
+	tileComplete physicsFrame2 = world->getComplete(-playerX - 0.4f, -(playerY + (playerYvelocity * (1.0f / elapsedTimef))) + 1);
+	if (below1.parent->id == 0 && below2.parent->id == 0) {
+		grounded = false;
+	}
+	if (physicsFrame1.parent->id != 0 && physicsFrame2.parent->id != 0 && !grounded)
+		playerYvelocity = -1.0f;
+	
+	//physics
+	//grounded = true;
+	if (playerYvelocity < gravity)
+		playerYvelocity = gravity;
+	if (grounded == true && playerYvelocity < 0) {
+		playerYvelocity = 0;
+	}
+	playerY += playerYvelocity * (1.0f / elapsedTimef);
+	//if (playerY < -31)
+	//	playerY = -31;
+}
+
+//Headless
+
+//world generation, edits and physics without any console or textures
+int runHeadless() {
+	const char *address = getOption("SERVER");
+	int chunks = getOptionInt("CHUNKS", 0);
+	int tickRate = getOptionInt("TICKRATE", address ? 20 : 0);
+	long long tickLimit = getOptionInt("TICKS", 0);
+	int soakEdits = getOptionInt("SOAK", 0);
+	int pathAgents = getOptionInt("PATHS", 0);
+	int rayCount = getOptionInt("RAYS", 0);
+	
+	if (chunks > 0) {
+		chunkCountX = chunkCountY = chunks;
+		tileMapWidth = chunkCountX * chunkSize;
+		tileMapHeight = chunkCountY * chunkSize;
+	}
+	
+	auto tp1 = std::chrono::steady_clock::now();
+	init();
+	generateWorld();
+	scheduler.cancel("generate");
+	auto tp2 = std::chrono::steady_clock::now();
+	fprintf(stderr, "generated %d chunks in %.1f ms\n", chunkCountX * chunkCountY, std::chrono::duration<float, std::milli>(tp2 - tp1).count());
+	
+	if (address) {
+		server = new chunkServer;
+		if (!server->listen(address)) {
+			fprintf(stderr, "could not listen on %s\n", address);
+			return 1;
+		}
+	}
+	
+	//physics steps as if each tick were a 50ms frame when running unlimited
+	float tickTimef = tickRate > 0 ? 1000.0f / tickRate : 50.0f;
+	auto tickTime = std::chrono::microseconds(tickRate > 0 ? 1000000 / tickRate : 0);
+	auto next = std::chrono::steady_clock::now();
+	auto reportTime = next;
+	long long ticks = 0, reportTicks = 0, edits = 0;
+	
+	//agents that ask for a new random path as soon as their last one is answered
+	std::vector<pathRequest> agents(pathAgents);
+	int reportSolved = 0;
+	
+	//one batch of random rays per tick, like line of sight checks for that many entities
+	std::vector<ray> rays(rayCount);
+	std::vector<rayHit> hits(rayCount);
+	long long raysCast = 0, reportRays = 0, rayHits = 0;
+	
+	while (!tickLimit || ticks < tickLimit) {
+		for (int i = 0; i < soakEdits; i++) {
+			int x = rand() % tileMapWidth, y = rand() % tileMapHeight;
+			world->place(x, y, tiles::get(rand() % tiles::id)->getDefaultState());
+			edits++;
+		}
+		
+		for (pathRequest &agent : agents) {
+			if (agent.state == pathRequest::PENDING)
+				continue;
+			agent.sx = rand() % tileMapWidth;
+			agent.sy = rand() % tileMapHeight;
+			agent.gx = rand() % tileMapWidth;
+			agent.gy = rand() % tileMapHeight;
+			paths->submit(&agent);
+		}
+		
+		if (rayCount) {
+			for (ray &r : rays) {
+				float angle = (rand() % 3600) * float(M_PI) / 1800.0f;
+				r = { float(rand() % tileMapWidth) + 0.5f, float(rand() % tileMapHeight) + 0.5f, cosf(angle), sinf(angle), 32.0f };
+			}
+			raycast(rays.data(), hits.data(), rayCount);
+			for (rayHit &hit : hits)
+				rayHits += hit.hit;
+			raysCast += rayCount;
+		}
+		
+		tickPhysics(tickTimef);
+		
+		if (server)
+			server->tick();
+		
+		ticks++;
+		
+		auto now = std::chrono::steady_clock::now();
+		float sinceReport = std::chrono::duration<float>(now - reportTime).count();
+		if (sinceReport >= 1.0f) {
+			fprintf(stderr, "%.1f ticks/sec, %lld ticks, %lld edits", (ticks - reportTicks) / sinceReport, ticks, edits);
+			if (pathAgents)
+				fprintf(stderr, ", %.1f paths/sec", (paths->solved - reportSolved) / sinceReport);
+			reportSolved = paths->solved;
+			if (rayCount)
+				fprintf(stderr, ", %.0f rays/sec, %lld hits", (raysCast - reportRays) / sinceReport, rayHits);
+			reportRays = raysCast;
+			if (server)
+				fprintf(stderr, ", %d consumers, %d chunks sent, %lld bytes sent", int(server->consumers.size()), server->chunksSent, server->bytesSent);
+			fprintf(stderr, "\n");
+			reportTime = now;
+			reportTicks = ticks;
+		}
+		
+		if (tickRate > 0) {
+			next += tickTime;
+			std::this_thread::sleep_until(next);
+		}
+	}
+	
+	float total = std::chrono::duration<float>(std::chrono::steady_clock::now() - tp2).count();
+	fprintf(stderr, "%lld ticks in %.2f s, %.1f ticks/sec\n", ticks, total, ticks / total);
+	
+	fprintf(stderr, "chunks: %d live, %d free, %d peak, %d slabs\n", int(chunkpool.live), int(chunkpool.capacity() - chunkpool.live), int(chunkpool.peak), int(chunkpool.slabCount));
+	
+	paths->stop();
+	
+	return 0;
+}
+
+#ifndef OW2D_NO_CONSOLE
+//background and world for one band of rows
+void drawBand(canvas *cv, int level) {
+	{		
+		for (int x = 0; x < frameWidth; x++) {
+			for (int y = cv->y0; y < cv->y1; y++) {
+				cv->write(x,y,'#', FGREEN | BBLACK);
+			}
+		}
+	}
+	
 	//background
 	{
 		int backgroundTexture[] = { 0, 2, 4, 5 };
 		//int backgroundTexture[] = { 4, 2, 8, 5 };
-		for (int x = 0; x < adv::width; x++) {
-			for (int y = 0; y < adv::height; y++) {
-				float xf = ((backgroundTexture[0] * textureSize) + ((float(x) / adv::width) * textureSize * 4)) / textureWidth;
-				float yf = ((backgroundTexture[1] * textureSize) + ((float(y) / adv::height) * textureSize * 3)) / textureHeight;				
+		for (int x = 0; x < frameWidth; x++) {
+			for (int y = cv->y0; y < cv->y1; y++) {
+				float xf = ((backgroundTexture[0] * textureSize) + ((float(x) / frameWidth) * textureSize * 4)) / textureWidth;
+				float yf = ((backgroundTexture[1] * textureSize) + ((float(y) / frameHeight) * textureSize * 3)) / textureHeight;				
 				ch_co_t chco = sampleImageCHCO(xf, yf);
 				if (chco.a < 255)
 					continue;
-				adv::write(x, y, chco.ch, chco.co);
+				cv->write(x, y, chco.ch, chco.co);
 			}
 		}
 	}
 	
 	//tiles
-	{
+	if (level > 1) {
+		drawSummaries(cv, level);
+	} else {
 		double  width = 2 * scale;
 		double height = 1 * scale;
 		tileComplete tc;
 		
-		for (int x = 0; x < tileMapWidth; x++) {
-			for (int y = 0; y < tileMapHeight; y++) {
+		//only the tile rows that reach into this band
+		int x0 = std::max(int(floor(-viewX)) - 1, 0), x1 = std::min(int(ceil(-viewX + frameWidth / width)) + 1, tileMapWidth);
+		int y0 = std::max(int(floor(-viewY + cv->y0 / height)) - 1, 0), y1 = std::min(int(ceil(-viewY + cv->y1 / height)) + 1, tileMapHeight);
+		
+		for (int x = x0; x < x1; x++) {
+			for (int y = y0; y < y1; y++) {
 				double offsetx = x + viewX;
 				double offsety = y + viewY;
 				
-				if (offsetx * width + width < 0 || offsety * height + height < 0 || offsetx * width + width - width > adv::width || offsety * height + height - height > adv::height)
+				if (offsetx * width + width < 0 || offsety * height + height < cv->y0 || offsetx * width + width - width > frameWidth || offsety * height + height - height > cv->y1)
+					continue;
+				
+				if (world->getChunk(x / chunkSize, y / chunkSize)->stage < GEN_FINALIZED)
 					continue;
 				
 				tc = world->getComplete(x,y);
-				tileState *state = tc.state;
 				
 				if (x == playerX && y == playerY)
 					tc.parent = gold;
 				
-				tc.parent->draw(&tc, offsetx * width, offsety * height, width, height);
+				tc.parent->draw(&tc, cv, offsetx * width, offsety * height, width, height);
 			}
 		}
 	}
+}
+
+void display() {
+	if (frameWidth != adv::width || frameHeight != adv::height) {
+		frameWidth = adv::width;
+		frameHeight = adv::height;
+		frameCells.assign(frameWidth * frameHeight, ch_co_t());
+	}
+	
+	//a few bands per thread so uneven rows still balance
+	int level = lodLevel();
+	int bandCount = std::min(frameHeight, int(workers->threads.size() + 1) * 4);
+	std::vector<canvas> bands(bandCount);
+	for (int i = 0; i < bandCount; i++)
+		bands[i] = { frameHeight * i / bandCount, frameHeight * (i + 1) / bandCount, 0, 0 };
+	workers->parallelFor(bandCount, [&](int i) {
+		drawBand(&bands[i], level);
+	});
+	
+	//everything on top of the world is drawn over the whole frame
+	canvas full = { 0, frameHeight, 0, 0 };
+	
+	//path preview
+	if (debugPath.state == pathRequest::FOUND) {
+		double  width = 2 * scale;
+		double height = 1 * scale;
+		for (auto &step : debugPath.path)
+			if (full.bound((step.first + viewX) * width + width * 0.5f, (step.second + viewY) * height + height * 0.5f))
+				full.write((step.first + viewX) * width + width * 0.5f, (step.second + viewY) * height + height * 0.5f, '*', FRED | BBLACK);
+	}
 	
 	//player
 	{
@@ -687,9 +2830,9 @@ void display() {
 				float xf = ((playerTexture[0] * textureSize) + ((float(x) / width) * textureSize)) / textureWidth;
 				float yf = ((playerTexture[1] * (textureSize * 2)) + ((float(y) / (height * 2)) * (textureSize * 2.0f))) / textureHeight;
 				ch_co_t chco = sampleImageCHCO(xf, yf);
-				if (chco.a < 255)
+				if (chco.a < 255 || !full.bound(((frameWidth / 2.0f) - (width / 2.0f)) + x, ((frameHeight / 2.0f) - ((height))) + y))
 					continue;
-				adv::write(((adv::width / 2.0f) - (width / 2.0f)) + x, ((adv::height / 2.0f) - ((height))) + y, chco.ch, chco.co);				
+				full.write(((frameWidth / 2.0f) - (width / 2.0f)) + x, ((frameHeight / 2.0f) - ((height))) + y, chco.ch, chco.co);				
 			}
 		}
 	}
@@ -704,8 +2847,28 @@ void display() {
 			cmp.parent = tiles::tileRegistry[i + 1];
 			tileState state = cmp.parent->getDefaultState();
 			cmp.state = &state;
-			tiles::tileRegistry[i + 1]->draw(&cmp, 0 + (width * i), 0 , width, height);
+			tiles::tileRegistry[i + 1]->draw(&cmp, &full, 0 + (width * i), 0 , width, height);
+		}
+	}
+	
+	for (canvas &band : bands) {
+		d_drawCallCount += band.drawCalls;
+		d_pixelDrawn += band.pixelsDrawn;
+	}
+	d_drawCallCount += full.drawCalls;
+	d_pixelDrawn += full.pixelsDrawn;
+	
+	for (int y = 0; y < frameHeight; y++) {
+		for (int x = 0; x < frameWidth; x++) {
+			ch_co_t &cell = frameCells[y * frameWidth + x];
+			adv::write(x, y, cell.ch, cell.co);
 		}
+	}
+	
+	//hotbar selection
+	{
+		int width = 2 * 4;
+		int height = 1 * 4;
 		adv::border(0 + (width * (selectorTileId - 1)), 0, 0 + (width * (selectorTileId - 1)) + width, 0 + height, FRED|BBLACK);
 	}	
 	
@@ -733,6 +2896,11 @@ void display() {
 		printVar("cheight", adv::height);
 		printVar("d_drawCallCount", d_drawCallCount);
 		printVar("d_pixelDrawn", d_pixelDrawn);
+		printVar("lodLevel", lodLevel());
+		printVar("chunksLive", chunkpool.live);
+		printVar("chunksFree", chunkpool.capacity() - chunkpool.live);
+		printVar("chunksPeak", chunkpool.peak);
+		printVar("tasksPending", scheduler.tasks.size());
 		printVar("playerX", playerX);
 		printVar("playerY", playerY);
 		printVar("playerXacc", playerXacceleration);
@@ -741,31 +2909,305 @@ void display() {
 		printVar("playerYvel", playerYvelocity);
 		printVar("viewBoxWidth", viewBoxWidth);
 		printVar("viewBoxHeight", viewBoxHeight);
+	}
+}
+
+//Input recording
+
+struct inputFrame {
+	float elapsed;
+	int key;
+	int steps;
+	int mouseX, mouseY;
+	unsigned long long mouseState;
+	bool mouseOk;
+	float worldX, worldY; //resolved cursor position, so edits land on the same tiles at any console size
+};
+
+//header: magic, version, seed, console size; then one record per frame
+struct inputLog {
+	FILE *file = nullptr;
+	bool replaying = false;
+	unsigned int seed;
+	int width, height;
+	
+	bool open(const char *path, bool replay);
+	void write(const inputFrame &frame);
+	bool read(inputFrame &frame);
+};
+
+inputLog *recorder;
+inputLog *replayer;
+FILE *timings;
+
+const unsigned int inputLogMagic = 0x5232574f; //OW2R
+const unsigned int inputLogVersion = 3;
+
+bool inputLog::open(const char *path, bool replay) {
+	replaying = replay;
+	file = fopen(path, replay ? "rb" : "wb");
+	if (!file)
+		return false;
+	
+	unsigned int header[5];
+	if (replay) {
+		if (fread(&header[0], sizeof(header), 1, file) != 1 || header[0] != inputLogMagic || header[1] != inputLogVersion) {
+			fclose(file);
+			file = nullptr;
+			return false;
+		}
+		seed = header[2];
+		width = header[3];
+		height = header[4];
+	} else {
+		header[0] = inputLogMagic;
+		header[1] = inputLogVersion;
+		header[2] = seed;
+		header[3] = width;
+		header[4] = height;
+		fwrite(&header[0], sizeof(header), 1, file);
+	}
+	return true;
+}
+
+//mouse fields are only stored for KEY_MOUSE frames
+void inputLog::write(const inputFrame &frame) {
+	fwrite(&frame.elapsed, 4, 1, file);
+	fwrite(&frame.key, 4, 1, file);
+	fwrite(&frame.steps, 4, 1, file);
+	if (frame.key == KEY_MOUSE) {
+		unsigned char ok = frame.mouseOk;
+		fwrite(&frame.mouseX, 4, 1, file);
+		fwrite(&frame.mouseY, 4, 1, file);
+		fwrite(&frame.mouseState, 8, 1, file);
+		fwrite(&ok, 1, 1, file);
+		fwrite(&frame.worldX, 4, 1, file);
+		fwrite(&frame.worldY, 4, 1, file);
+	}
+}
+
+bool inputLog::read(inputFrame &frame) {
+	frame = inputFrame();
+	if (fread(&frame.elapsed, 4, 1, file) != 1 || fread(&frame.key, 4, 1, file) != 1 || fread(&frame.steps, 4, 1, file) != 1)
+		return false;
+	if (frame.key == KEY_MOUSE) {
+		unsigned char ok;
+		if (fread(&frame.mouseX, 4, 1, file) != 1 || fread(&frame.mouseY, 4, 1, file) != 1 || fread(&frame.mouseState, 8, 1, file) != 1 || fread(&ok, 1, 1, file) != 1
+			|| fread(&frame.worldX, 4, 1, file) != 1 || fread(&frame.worldY, 4, 1, file) != 1)
+			return false;
+		frame.mouseOk = ok;
+	}
+	return true;
+}
+
+#endif
+
+//Map export
+
+//one pixel per tile, streamed in strips of columns, each a chunk row at a time through a sliding window of generated rows
+//memory depends on the strip width only, not on the size of the map
+int runExport(const char *path) {
+	int worldX = getOptionInt("CHUNKS", chunkCountX), worldY = getOptionInt("CHUNKS", chunkCountY);
+	int rx = 0, ry = 0, rw = worldX, rh = worldY;
+	if (const char *rect = getOption("EXPORT_RECT"))
+		sscanf(rect, "%d,%d,%d,%d", &rx, &ry, &rw, &rh);
+	rx = std::min(std::max(rx, 0), worldX - 1);
+	ry = std::min(std::max(ry, 0), worldY - 1);
+	rw = std::min(std::max(rw, 1), worldX - rx);
+	rh = std::min(std::max(rh, 1), worldY - ry);
+	int stripWidth = std::max(getOptionInt("EXPORT_STRIP", 256), 1);
+	
+	texture = stbi_load("textures.png", (int*)&textureWidth, (int*)&textureHeight, &bpp, 0);
+	if (!texture) {
+		fprintf(stderr, "could not load textures.png\n");
+		return 1;
+	}
+	pixel colors[TILE_COUNT];
+	for (int i = 0; i < TILE_COUNT; i++) {
+		tile *t = tiles::tileRegistry[i];
+		if (!t || t == air || !atlasAverage(t->textureAtlas[0], t->textureAtlas[1], 1, 1, &colors[i]))
+			atlasAverage(0, 2, 4, 3, &colors[i]);
+	}
+	
+	FILE *out = fopen(path, "wb");
+	if (!out) {
+		fprintf(stderr, "could not write %s\n", path);
+		return 1;
+	}
+	fprintf(out, "P6\n%d %d\n255\n", rw * chunkSize, rh * chunkSize);
+	long long header = ftello(out);
+	long long lineBytes = (long long)rw * chunkSize * 3;
+	
+	startWorkers();
+	
+	world = new world_t;
+	world->chunks = new chunk_t*[(std::min(stripWidth, rw) + 6) * 7];
+	
+	std::deque<std::vector<chunk_t*>> rows;
+	int strips = (rw + stripWidth - 1) / stripWidth;
+	std::vector<unsigned char> band(std::min(stripWidth, rw) * chunkSize * chunkSize * 3);
+	
+	auto tp1 = std::chrono::steady_clock::now();
+	auto reportTime = tp1;
+	long long chunksDone = 0, reportChunks = 0;
+	
+	for (int strip = 0; strip < strips; strip++) {
+		int sx = rx + strip * stripWidth, sw = std::min(stripWidth, rx + rw - sx);
 		
-		d_drawCallCount = 0;
-		d_pixelDrawn = 0;
+		//finalizing a row needs decorated rows two out, which need carved rows three out, the same goes for columns
+		int wx0 = std::max(sx - 3, 0), wx1 = std::min(sx + sw + 3, worldX);
+		chunkCountX = wx1 - wx0;
+		tileMapWidth = chunkCountX * chunkSize;
+		world->originX = wx0;
+		int firstRow = 0;
+		
+		for (int r = ry; r < ry + rh; r++) {
+			int lo = std::max(r - 3, 0), hi = std::min(r + 3, worldY - 1);
+			while (rows.size() && firstRow < lo) {
+				for (chunk_t *chunk : rows.front())
+					chunkpool.free(chunk);
+				rows.pop_front();
+				firstRow++;
+			}
+			if (rows.empty())
+				firstRow = lo;
+			while (firstRow + (int)rows.size() <= hi) {
+				std::vector<chunk_t*> row;
+				for (int cx = wx0; cx < wx1; cx++) {
+					chunk_t *chunk = allocChunk();
+					chunk->originX = cx;
+					chunk->originY = firstRow + rows.size();
+					chunk->stage = GEN_NONE;
+					row.push_back(chunk);
+				}
+				rows.push_back(row);
+			}
+			
+			world->originY = firstRow;
+			chunkCountY = rows.size();
+			tileMapHeight = chunkCountY * chunkSize;
+			for (int y = 0; y < chunkCountY; y++)
+				for (int x = 0; x < chunkCountX; x++)
+					world->chunks[y * chunkCountX + x] = rows[y][x];
+			
+			generateWorld([&](chunk_t *chunk) {
+				int d = std::max(abs(chunk->originY - r), std::max(sx - chunk->originX, chunk->originX - (sx + sw - 1)));
+				return d == 0 ? GEN_FINALIZED : (d <= 2 ? GEN_DECORATED : GEN_CARVED);
+			});
+			
+			workers->parallelFor(sw, [&](int i) {
+				chunk_t *chunk = world->getChunk(sx + i, r);
+				for (int x = 0; x < chunkSize; x++) {
+					for (int y = 0; y < chunkSize; y++) {
+						tile_id id = chunk->tileMap[x][y].id;
+						pixel pix = colors[id < TILE_COUNT ? id : 0];
+						unsigned char *p = &band[((y * sw * chunkSize) + i * chunkSize + x) * 3];
+						p[0] = pix.r;
+						p[1] = pix.g;
+						p[2] = pix.b;
+					}
+				}
+			});
+			//the strip's part of each image line
+			for (int y = 0; y < chunkSize; y++) {
+				fseeko(out, header + ((long long)(r - ry) * chunkSize + y) * lineBytes + (long long)(sx - rx) * chunkSize * 3, SEEK_SET);
+				fwrite(&band[y * sw * chunkSize * 3], 1, sw * chunkSize * 3, out);
+			}
+			chunksDone += sw;
+			
+			auto now = std::chrono::steady_clock::now();
+			float sinceReport = std::chrono::duration<float>(now - reportTime).count();
+			if (sinceReport >= 1.0f) {
+				fprintf(stderr, "strip %d/%d, row %d/%d, %.1f chunks/sec\n", strip + 1, strips, r - ry + 1, rh, (chunksDone - reportChunks) / sinceReport);
+				reportTime = now;
+				reportChunks = chunksDone;
+			}
+		}
+		
+		for (auto &row : rows)
+			for (chunk_t *chunk : row)
+				chunkpool.free(chunk);
+		rows.clear();
 	}
+	fclose(out);
+	
+	float total = std::chrono::duration<float>(std::chrono::steady_clock::now() - tp1).count();
+	fprintf(stderr, "exported %lld chunks (%dx%d tiles) in %.2f s, %.1f chunks/sec, %d chunks peak\n", chunksDone, rw * chunkSize, rh * chunkSize, total, chunksDone / total, int(chunkpool.peak));
+	
+	if (!getOption("EXPORT_CHECK"))
+		return 0;
+	
+	//the whole world again in one piece through generateWorld, the image has to match it pixel for pixel
+	delete [] world->chunks;
+	delete world;
+	
+	chunkCountX = worldX;
+	chunkCountY = worldY;
+	tileMapWidth = chunkCountX * chunkSize;
+	tileMapHeight = chunkCountY * chunkSize;
+	world = new world_t;
+	world->chunks = new chunk_t*[chunkCountX * chunkCountY];
+	for (int i = 0; i < chunkCountX * chunkCountY; i++) {
+		chunk_t *chunk = world->chunks[i] = allocChunk();
+		chunk->originX = i % chunkCountX;
+		chunk->originY = i / chunkCountX;
+		chunk->stage = GEN_NONE;
+	}
+	chunkCountPrev = chunkCountX * chunkCountY;
+	generateWorld();
+	
+	FILE *in = fopen(path, "rb");
+	int width = 0, height = 0;
+	if (!in || fscanf(in, "P6 %d %d 255", &width, &height) != 2 || fgetc(in) == EOF || width != rw * chunkSize || height != rh * chunkSize) {
+		fprintf(stderr, "could not read back %s\n", path);
+		if (in)
+			fclose(in);
+		return 1;
+	}
+	long long wrong = 0;
+	std::vector<unsigned char> line(width * 3);
+	for (int y = 0; y < height; y++) {
+		if (fread(line.data(), 1, line.size(), in) != line.size()) {
+			wrong += (long long)(height - y) * width;
+			break;
+		}
+		for (int x = 0; x < width; x++) {
+			tile_id id = world->getState(rx * chunkSize + x, ry * chunkSize + y)->id;
+			pixel pix = colors[id < TILE_COUNT ? id : 0];
+			unsigned char *p = &line[x * 3];
+			wrong += p[0] != pix.r || p[1] != pix.g || p[2] != pix.b;
+		}
+	}
+	fclose(in);
+	fprintf(stderr, "check: %lld of %lld pixels differ from generateWorld\n", wrong, (long long)width * height);
+	return wrong ? 1 : 0;
 }
 
+#ifdef OW2D_NO_CONSOLE
+int main() {
+	world = nullptr;
+	chunkpool.hugePages = getOptionInt("HUGEPAGES", 0);
+	worldSeed = getOption("SEED") ? getOptionInt("SEED", 0) : time(NULL);
+	
+	if (const char *path = getOption("EXPORT"))
+		return runExport(path);
+	return runHeadless();
+}
+#else
 int wmain() {
+	world = nullptr;
+	chunkpool.hugePages = getOptionInt("HUGEPAGES", 0);
+	worldSeed = getOption("SEED") ? getOptionInt("SEED", 0) : time(NULL);
+	
 	colormapper_init_table();
 	
 	texture = stbi_load("textures.png", (int*)&textureWidth, (int*)&textureHeight, &bpp, 0);
 	
 	texturechco = new ch_co_t[textureWidth * textureHeight];
 	
-	world = nullptr;
-	
-	for (int x = 0; x < textureWidth; x++) {
-		for (int y = 0; y < textureHeight; y++) {
-			pixel pix = sampleImage(float(x) / textureWidth, float(y) / textureHeight);
-	tileComplete getComplete(int x, int y);
-			ch_co_t chco;
-			chco.a = pix.a;
-			getDitherColored(pix.r, pix.g, pix.b, &chco.ch, &chco.co);
-			texturechco[int(y * textureWidth) + int(x)] = chco;
-		}
-	}
+	buildColorLut();
+	convertTexture();
+	buildTileColors();
 	
 	while (!adv::ready) console::sleep(10);
 	
@@ -775,16 +3217,67 @@ int wmain() {
 	printf("\033[?1003h\n");
 	mouseinterval(1);
 	mousemask(ALL_MOUSE_EVENTS, NULL);
-	MEVENT event;
+	MEVENT event = {};
+	
+	if (const char *path = getOption("REPLAY")) {
+		replayer = new inputLog;
+		if (!replayer->open(path, true)) {
+			fprintf(stderr, "could not read input log %s\n", path);
+			return 1;
+		}
+		worldSeed = replayer->seed;
+		if (replayer->width != adv::width || replayer->height != adv::height)
+			fprintf(stderr, "warning: %s was recorded at %dx%d, replaying at %dx%d; edits replay on the recorded tiles but drawing and timings are not comparable\n", path, replayer->width, replayer->height, adv::width, adv::height);
+	} else
+	if (const char *path = getOption("RECORD")) {
+		recorder = new inputLog;
+		recorder->seed = worldSeed;
+		recorder->width = adv::width;
+		recorder->height = adv::height;
+		if (!recorder->open(path, false)) {
+			delete recorder;
+			recorder = nullptr;
+		}
+	}
+	
+	if (const char *address = getOption("CONNECT")) {
+		client = new chunkClient;
+		if (!client->connect(address)) {
+			delete client;
+			client = nullptr;
+		}
+	}
 	
 	init();
 	
+	if (const char *path = getOption("TIMINGS")) {
+		timings = fopen(path, "w");
+		if (timings && replayer)
+			fprintf(timings, "# recorded at %dx%d, replaying at %dx%d\n", replayer->width, replayer->height, adv::width, adv::height);
+		if (timings)
+			fprintf(timings, "frame,elapsed_ms,work_ms,draw_calls,pixels_drawn,task_steps\n");
+	}
+	bool replayFast = getOptionInt("REPLAY_FAST", 0);
+	int frameCount = 0;
+	
 	int key = 0;
 	
 	auto tp1 = std::chrono::system_clock::now();
 	auto tp2 = std::chrono::system_clock::now();
 	
-	while (!HASKEY(key = console::readKeyAsync(), VK_ESCAPE)) {
+	while (true) {
+		auto frameStart = std::chrono::steady_clock::now();
+		inputFrame frame = inputFrame();
+		if (replayer) {
+			if (!replayer->read(frame))
+				break;
+			key = frame.key;
+		} else {
+			key = frame.key = console::readKeyAsync();
+		}
+		if (HASKEY(key, VK_ESCAPE))
+			break;
+		
 		adv::clear();
 		
 		switch (key) {
@@ -799,16 +3292,33 @@ int wmain() {
 				float offsety = m_offsety = -(viewY);
 				m_posx = offsetx + (event.x / float(width));
 				m_posy = offsety + (event.y / float(height));
-				if (getmouse(&event) == OK) {
+				bool mouseOk;
+				if (replayer) {
+					event.x = frame.mouseX;
+					event.y = frame.mouseY;
+					event.bstate = frame.mouseState;
+					mouseOk = frame.mouseOk;
+					m_posx = frame.worldX;
+					m_posy = frame.worldY;
+				} else {
+					mouseOk = getmouse(&event) == OK;
+					frame.mouseX = event.x;
+					frame.mouseY = event.y;
+					frame.mouseState = event.bstate;
+					frame.mouseOk = mouseOk;
+					frame.worldX = m_posx;
+					frame.worldY = m_posy;
+				}
+				if (mouseOk) {
 					if (event.x < 8 * 8 && event.y < 4) {
 						if (event.bstate & BUTTON1_RELEASED) {
 							selectorTileId = ((float(event.x) / (8.0f)) + 1);
 						}
 					}
-					if (event.bstate & BUTTON1_RELEASED)
-						world->place(int(m_posx), int(m_posy), tiles::AIR->getDefaultState());
-					if (event.bstate & BUTTON3_RELEASED)
-						world->place(int(m_posx), int(m_posy), tiles::get(selectorTileId)->getDefaultState());
+					if ((event.bstate & BUTTON1_RELEASED) && canReach(int(m_posx), int(m_posy)))
+						placeTile(int(m_posx), int(m_posy), tiles::AIR->getDefaultState());
+					if ((event.bstate & BUTTON3_RELEASED) && canReach(int(m_posx), int(m_posy)))
+						placeTile(int(m_posx), int(m_posy), tiles::get(selectorTileId)->getDefaultState());
 				}
 			}
 				break;				
@@ -845,22 +3355,56 @@ int wmain() {
 					break;
 			case ',':
 			//case 'z':
-				scale+=0.25f;
+				if (scale < 0.5f)
+					scale*=2.0f;
+				else
+					scale+=0.25f;
 				break;
 			case '.':
 			//case 'x':
 				if (scale > 0.5f)
 					scale-=0.25f;
+				else
+				if (scale > minScale)
+					scale*=0.5f;
 				break;
 			case '/':
 				scale = 4;
 				break;
 			case '0':
+				worldSeed = rand();
 				init();
 				break;
 			case 'o':
 				infoMode = !infoMode;
 				break;
+			case 'p':
+				if (debugPath.state != pathRequest::PENDING && paths) {
+					debugPath.sx = -playerX;
+					debugPath.sy = -playerY;
+					debugPath.gx = m_posx;
+					debugPath.gy = m_posy;
+					paths->submit(&debugPath);
+				}
+				break;
+			case 'n':
+				if (textureTintTarget.b == 255)
+					textureTintTarget = pixel(90, 110, 170);
+				else
+					textureTintTarget = pixel(255, 255, 255);
+				break;
+		}
+		
+		//fade the atlas toward the target tint, reconverting it each frame while it changes
+		if (textureTint.r != textureTintTarget.r || textureTint.g != textureTintTarget.g || textureTint.b != textureTintTarget.b) {
+			auto step = [](color_t c, color_t t) {
+				return color_t(c < t ? std::min(c + 15, int(t)) : std::max(c - 15, int(t)));
+			};
+			textureTint.r = step(textureTint.r, textureTintTarget.r);
+			textureTint.g = step(textureTint.g, textureTintTarget.g);
+			textureTint.b = step(textureTint.b, textureTintTarget.b);
+			convertTexture();
+			buildTileColors();
 		}
 		
 		float frameTimeTarget = 33.3333f;
@@ -872,33 +3416,17 @@ int wmain() {
 		//std::chrono::duration<float, std::milli> elapsedTimef = t2 - t1;
 		tp1 = tp2;
 		
+		//replays step physics with the recorded frame times
+		if (replayer)
+			elapsedTimef = frame.elapsed;
+		frame.elapsed = elapsedTimef;
 		
+		tickPhysics(elapsedTimef);
 		
-		playerYvelocity = playerYvelocity + (gravity * (1.0f/elapsedTimef));
-		
-		grounded = true;
-		//collision check
-		tileComplete below1 = world->getComplete(-playerX + 0.4f, -playerY+1);
-		tileComplete below2 = world->getComplete(-playerX - 0.4f, -playerY+1);
-		tileComplete physicsFrame1 = world->getComplete(-playerX + 0.4f, -(playerY + (playerYvelocity * (1.0f / elapsedTimef))) + 1);
-		tileComplete physicsFrame2 = world->getComplete(-playerX - 0.4f, -(playerY + (playerYvelocity * (1.0f / elapsedTimef))) + 1);
-		if (below1.parent->id == 0 && below2.parent->id == 0) {
-			grounded = false;
+		if (client) {
+			client->setView(int(-playerX) / chunkSize, int(-playerY) / chunkSize);
+			client->poll();
 		}
-		if (physicsFrame1.parent->id != 0 && physicsFrame2.parent->id != 0 && !grounded)
-			playerYvelocity = -1.0f;
-		
-		//physics
-		//grounded = true;
-		if (playerYvelocity < gravity)
-			playerYvelocity = gravity;
-		if (grounded == true && playerYvelocity < 0) {
-			playerYvelocity = 0;
-		}
-		playerY += playerYvelocity * (1.0f / elapsedTimef);
-		//if (playerY < -31)
-		//	playerY = -31;
-		
 		
 		viewBoxWidth = double(adv::width) / (2.0d * scale);
 		viewBoxHeight = double(adv::height) / (1.0d * scale);
@@ -906,9 +3434,23 @@ int wmain() {
 		viewX = playerX + (viewBoxWidth * 0.5f);
 		viewY = playerY + (viewBoxHeight * 0.5f);
 				
+		d_drawCallCount = 0;
+		d_pixelDrawn = 0;
 		display();
-		if (elapsedTimef < frameTimeTarget)
-			console::sleep(frameTimeTarget - elapsedTimef);
+		float work = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+		
+		//background tasks get what is left of the frame, less a reserve for drawing to the console
+		auto deadline = frameStart + std::chrono::microseconds(int((frameTimeTarget - frameReserve) * 1000.0f));
+		frame.steps = replayer ? scheduler.runSteps(frame.steps) : scheduler.run(deadline);
+		if (recorder)
+			recorder->write(frame);
+		
+		if (timings)
+			fprintf(timings, "%d,%.3f,%.3f,%d,%d,%d\n", frameCount, elapsedTimef, work, d_drawCallCount, d_pixelDrawn, frame.steps);
+		frameCount++;
+		float frameUsed = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+		if (frameUsed < frameTimeTarget && !(replayer && replayFast))
+			console::sleep(frameTimeTarget - frameUsed);
 		//console::sleep(20);
 		
 		{
@@ -920,7 +3462,13 @@ int wmain() {
 		adv::draw();
 	}
 	
+	if (recorder)
+		fclose(recorder->file);
+	if (timings)
+		fclose(timings);
+	
 	//adv::construct.~constructor();
 	
 	return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file